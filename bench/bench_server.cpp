@@ -0,0 +1,138 @@
+// Target app for six_bench, with one route per README scenario.
+//
+// Build and run from the bench/ directory so templates/ is found:
+//   cd bench
+//   g++ -std=c++17 -O2 -pthread bench_server.cpp -o bench_server -lsqlite3 -largon2 -lz -lssl -lcrypto
+//   ./bench_server [port] [workers] [shards] [epoll|io_uring]
+//
+// Then, from another shell:
+//   ./six_bench --scenario static
+//   ./six_bench --scenario sql -c 32
+//
+// Comparing backends:
+//   ./bench_server 8000 4 1 epoll     &  ./six_bench -s static -c 256 -p 8
+//   ./bench_server 8000 4 1 io_uring  &  ./six_bench -s static -c 256 -p 8
+
+#include <string>
+#include <cstdlib>
+#include "../six.h"
+
+using namespace std;
+
+static const int POST_COUNT = 50;
+
+static void seed_database() {
+    six_sql_exec(
+        "CREATE TABLE IF NOT EXISTS users ("
+        "id INTEGER PRIMARY KEY AUTOINCREMENT, "
+        "name TEXT NOT NULL, "
+        "email TEXT UNIQUE NOT NULL, "
+        "hashed_password TEXT NOT NULL, "
+        "is_admin INTEGER DEFAULT 0 "
+        ")"
+    );
+    six_sql_exec(
+        "CREATE TABLE IF NOT EXISTS posts ("
+        "id INTEGER PRIMARY KEY AUTOINCREMENT, "
+        "title TEXT NOT NULL, "
+        "body TEXT NOT NULL "
+        ")"
+    );
+
+    if (!six_sql_find_by_readonly("users", "email", "bench@example.com")) {
+        six_sql_insert("users", {
+            {"name", "bench"},
+            {"email", "bench@example.com"},
+            {"hashed_password", generate_password_hash("bench-password")},
+            {"is_admin", "0"}
+        });
+    }
+
+    if (six_sql_query_all("posts").size() < (size_t)POST_COUNT) {
+        for (int i = 1; i <= POST_COUNT; ++i) {
+            six_sql_insert("posts", {
+                {"title", "Post " + to_string(i)},
+                {"body", "Lorem ipsum dolor sit amet, consectetur adipiscing elit."}
+            });
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    int port = argc > 1 ? atoi(argv[1]) : 8000;
+    int workers = argc > 2 ? atoi(argv[2]) : 4;
+    int shards = argc > 3 ? atoi(argv[3]) : 1;
+    IoBackend backend = argc > 4 && string(argv[4]) == "io_uring" ? IoBackend::IoUring : IoBackend::Epoll;
+
+    seed_database();
+
+    six server(port, workers, shards, backend);
+    server.setKeepAlive(60, 1000000);
+    server.setAccessLog(LogFormat::Off);
+    server.enableMetrics();
+
+    // static
+    routeGet("/") {
+        return http_response("Hello, World!");
+    } end();
+
+    // param
+    routeGet("/user/{username}") {
+        return "Hello " + getParam("username");
+    } end();
+
+    routeGet("/user/{username}/posts/{post_id}") {
+        return "User: " + getParam("username") + ", Post: " + getParam("post_id");
+    } end();
+
+    // template
+    routeGet("/template") {
+        vector<map<string, string>> posts;
+        for (int i = 1; i <= 10; ++i) {
+            posts.push_back({{"id", to_string(i)}, {"title", "Post " + to_string(i)}, {"body", "Static body"}});
+        }
+
+        vars ctx;
+        ctx["title"] = string("Template");
+        ctx["user"] = string("bench");
+        ctx["posts"] = posts;
+        return render_template("bench.html", ctx);
+    } end();
+
+    // login
+    routePost("/login") {
+        const string email = req.forms.get("email");
+        const string password = req.forms.get("password");
+
+        auto user = six_sql_find_by("users", "email", email.c_str());
+        if (!user || !verify_password(password, user["hashed_password"])) {
+            http_response res("Invalid email or password");
+            res.status = 401;
+            return res;
+        }
+
+        login_user(user);
+        return redirect("/dashboard");
+    } end();
+
+    // sql
+    routeGet("/posts") {
+        vars ctx;
+        ctx["title"] = string("Posts");
+        ctx["posts"] = convertToTemplateData(six_sql_query_all("posts"));
+        return render_template("bench.html", ctx);
+    } end();
+
+    routeGet("/posts/{id}") {
+        SQLRow post = six_sql_find_by_readonly("posts", "id", getParam("id"));
+        if (!post) {
+            http_response res("Not found");
+            res.status = 404;
+            return res;
+        }
+        return "<h1>" + post["title"] + "</h1><p>" + post["body"] + "</p>";
+    } end();
+
+    server.start();
+    return 0;
+}
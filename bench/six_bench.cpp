@@ -0,0 +1,574 @@
+// HTTP/1.1 load generator for six.
+//
+// Build:
+//   g++ -std=c++17 -O2 -pthread bench/six_bench.cpp -o six_bench
+//
+// Run against bench/bench_server.cpp (or any six app):
+//   ./six_bench --scenario param -c 128 -p 4 -d 15
+//   ./six_bench -r "GET /" -r "3*GET /user/alice" --json result.json
+//
+// Prints a JSON summary to stdout (or to --json FILE) with requests per
+// second, latency percentiles and response status counts.
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "../core/six_metrics.h"
+
+using namespace std;
+using Clock = std::chrono::steady_clock;
+
+struct RequestSpec {
+    string method;
+    string path;
+    string body;
+    int weight = 1;
+};
+
+struct Options {
+    string host = "127.0.0.1";
+    int port = 8000;
+    int connections = 64;
+    int threads = (int)std::max(1u, std::thread::hardware_concurrency() / 2);
+    int pipeline = 1;
+    double duration = 10;
+    double warmup = 1;
+    bool keep_alive = true;
+    string scenario = "static";
+    vector<RequestSpec> requests;
+    string json_path;
+};
+
+// Scenarios match the routes in bench/bench_server.cpp, which follow the
+// README examples.
+static vector<RequestSpec> scenario_requests(const string& name) {
+    if (name == "static") return {{"GET", "/", "", 1}};
+    if (name == "param") return {{"GET", "/user/alice", "", 1}, {"GET", "/user/bob/posts/42", "", 1}};
+    if (name == "template") return {{"GET", "/template", "", 1}};
+    if (name == "login") return {{"POST", "/login", "email=bench%40example.com&password=bench-password", 1}};
+    if (name == "sql") return {{"GET", "/posts", "", 1}, {"GET", "/posts/1", "", 1}};
+    if (name == "mixed") {
+        return {
+            {"GET", "/", "", 4},
+            {"GET", "/user/alice", "", 3},
+            {"GET", "/template", "", 2},
+            {"GET", "/posts", "", 1},
+        };
+    }
+    return {};
+}
+
+// "[weight*]METHOD PATH [BODY]", e.g. "3*POST /login a=1&b=2".
+static bool parse_request(const string& text, RequestSpec& spec) {
+    string rest = text;
+    size_t star = rest.find('*');
+    if (star != string::npos && star < rest.find(' ')) {
+        spec.weight = std::max(1, atoi(rest.substr(0, star).c_str()));
+        rest = rest.substr(star + 1);
+    }
+    istringstream in(rest);
+    in >> spec.method >> spec.path;
+    getline(in >> ws, spec.body);
+    return !spec.method.empty() && !spec.path.empty() && spec.path[0] == '/';
+}
+
+static void usage() {
+    cerr << "usage: six_bench [options]\n"
+            "  --host HOST          server address (127.0.0.1)\n"
+            "  --port PORT          server port (8000)\n"
+            "  -c, --connections N  open connections (64)\n"
+            "  -t, --threads N      client threads (half the cores)\n"
+            "  -p, --pipeline N     requests in flight per connection (1)\n"
+            "  -d, --duration SECS  measured time (10)\n"
+            "  -w, --warmup SECS    unmeasured time before that (1)\n"
+            "  --no-keepalive       one request per connection\n"
+            "  -s, --scenario NAME  static, param, template, login, sql, mixed (static)\n"
+            "  -r, --request SPEC   \"[weight*]METHOD PATH [BODY]\", repeatable; replaces the scenario\n"
+            "  --json FILE          write the summary to FILE instead of stdout\n";
+}
+
+static bool parse_options(int argc, char** argv, Options& opts) {
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        auto value = [&]() -> const char* {
+            if (i + 1 >= argc) {
+                cerr << "missing value for " << arg << "\n";
+                exit(2);
+            }
+            return argv[++i];
+        };
+
+        if (arg == "--host") opts.host = value();
+        else if (arg == "--port") opts.port = atoi(value());
+        else if (arg == "-c" || arg == "--connections") opts.connections = atoi(value());
+        else if (arg == "-t" || arg == "--threads") opts.threads = atoi(value());
+        else if (arg == "-p" || arg == "--pipeline") opts.pipeline = atoi(value());
+        else if (arg == "-d" || arg == "--duration") opts.duration = atof(value());
+        else if (arg == "-w" || arg == "--warmup") opts.warmup = atof(value());
+        else if (arg == "--no-keepalive") opts.keep_alive = false;
+        else if (arg == "-s" || arg == "--scenario") opts.scenario = value();
+        else if (arg == "--json") opts.json_path = value();
+        else if (arg == "-r" || arg == "--request") {
+            RequestSpec spec;
+            if (!parse_request(value(), spec)) {
+                cerr << "bad request spec: " << argv[i] << "\n";
+                return false;
+            }
+            opts.requests.push_back(spec);
+        } else {
+            usage();
+            return false;
+        }
+    }
+
+    if (opts.requests.empty()) {
+        opts.requests = scenario_requests(opts.scenario);
+        if (opts.requests.empty()) {
+            cerr << "unknown scenario: " << opts.scenario << "\n";
+            return false;
+        }
+    } else {
+        opts.scenario = "custom";
+    }
+
+    opts.connections = std::max(1, opts.connections);
+    opts.threads = std::clamp(opts.threads, 1, opts.connections);
+    opts.pipeline = std::max(1, opts.pipeline);
+    if (!opts.keep_alive) opts.pipeline = 1;
+    return opts.duration > 0;
+}
+
+// One request in the rotation, ready to send.
+struct Scheduled {
+    string text;
+    bool head = false;
+};
+
+struct Stats {
+    Histogram latency;
+    std::atomic<uint64_t> requests{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> status[6] = {};
+    std::atomic<uint64_t> connect_errors{0};
+    std::atomic<uint64_t> io_errors{0};
+    std::atomic<uint64_t> parse_errors{0};
+    std::atomic<uint64_t> unanswered{0};
+    std::atomic<uint64_t> max_us{0};
+};
+
+// Parses one response off the front of `in`. Returns the bytes it took, 0
+// if it is incomplete, or -1 if it can't be parsed. Answers to HEAD
+// (`head`) have no body whatever their headers say; other bodies without a
+// length run to the end of the connection (`eof`).
+static long parse_response(const string& in, bool head, bool eof, int& status, bool& close_after) {
+    size_t head_end = in.find("\r\n\r\n");
+    if (head_end == string::npos) return 0;
+    if (in.compare(0, 5, "HTTP/") != 0) return -1;
+
+    size_t space = in.find(' ');
+    if (space == string::npos || space > head_end) return -1;
+    status = atoi(in.c_str() + space + 1);
+
+    long content_length = -1;
+    bool chunked = false;
+    close_after = in.compare(0, 8, "HTTP/1.0") == 0;
+
+    size_t pos = in.find("\r\n") + 2;
+    while (pos < head_end) {
+        size_t end = in.find("\r\n", pos);
+        string line = in.substr(pos, end - pos);
+        pos = end + 2;
+
+        size_t colon = line.find(':');
+        if (colon == string::npos) continue;
+        string name = line.substr(0, colon);
+        string value = line.substr(colon + 1);
+        for (auto& c : name) c = (char)tolower((unsigned char)c);
+        for (auto& c : value) c = (char)tolower((unsigned char)c);
+        value.erase(0, value.find_first_not_of(" \t"));
+
+        if (name == "content-length") content_length = atol(value.c_str());
+        else if (name == "transfer-encoding") chunked = value.find("chunked") != string::npos;
+        else if (name == "connection") close_after = value.find("close") != string::npos ? true
+                                                     : value.find("keep-alive") != string::npos ? false
+                                                     : close_after;
+    }
+
+    size_t body = head_end + 4;
+    if (head || status == 204 || status == 304 || (status >= 100 && status < 200)) return (long)body;
+
+    if (chunked) {
+        size_t at = body;
+        while (true) {
+            size_t line_end = in.find("\r\n", at);
+            if (line_end == string::npos) return 0;
+            unsigned long size = strtoul(in.c_str() + at, nullptr, 16);
+            at = line_end + 2;
+            if (size == 0) {
+                size_t trailer_end = in.find("\r\n", at);
+                if (trailer_end == string::npos) return 0;
+                if (trailer_end != at) {
+                    trailer_end = in.find("\r\n\r\n", at);
+                    if (trailer_end == string::npos) return 0;
+                    trailer_end += 2;
+                }
+                return (long)(trailer_end + 2);
+            }
+            if (in.size() < at + size + 2) return 0;
+            at += size + 2;
+        }
+    }
+
+    if (content_length >= 0) {
+        return in.size() >= body + content_length ? (long)(body + content_length) : 0;
+    }
+    close_after = true;
+    return eof ? (long)in.size() : 0;
+}
+
+class Worker {
+public:
+    Worker(const Options& opts, const sockaddr_in& addr, const vector<Scheduled>& schedule, Stats& stats,
+           int connections, Clock::time_point measure_from, Clock::time_point stop_at)
+        : opts(opts), addr(addr), schedule(schedule), stats(stats),
+          measure_from(measure_from), stop_at(stop_at), conns(connections) {}
+
+    void run() {
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        for (size_t i = 0; i < conns.size(); ++i) {
+            conns[i].next = i * 7919;
+            open(conns[i]);
+        }
+
+        epoll_event events[256];
+        auto drain_until = stop_at + std::chrono::seconds(2);
+        while (true) {
+            auto now = Clock::now();
+            bool stopping = now >= stop_at;
+            if (stopping && (inFlight() == 0 || now >= drain_until)) break;
+
+            int n = epoll_wait(epoll_fd, events, 256, 50);
+            for (int i = 0; i < n; ++i) {
+                Conn& conn = conns[events[i].data.u32];
+                if (conn.fd < 0) continue;
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) readable(conn);
+                if (conn.fd >= 0 && (events[i].events & EPOLLOUT)) fill(conn);
+            }
+        }
+
+        stats.unanswered.fetch_add(inFlight(), std::memory_order_relaxed);
+        for (auto& conn : conns) {
+            if (conn.fd >= 0) close(conn.fd);
+        }
+        close(epoll_fd);
+    }
+
+private:
+    // A request written but not yet answered.
+    struct Sent {
+        Clock::time_point at;
+        bool head = false;
+    };
+
+    struct Conn {
+        int fd = -1;
+        bool connected = false;
+        string out;
+        size_t out_offset = 0;
+        string in;
+        deque<Sent> sent;
+        size_t next = 0;
+    };
+
+    const Options& opts;
+    sockaddr_in addr;
+    const vector<Scheduled>& schedule;
+    Stats& stats;
+    Clock::time_point measure_from;
+    Clock::time_point stop_at;
+    vector<Conn> conns;
+    int epoll_fd = -1;
+
+    size_t inFlight() const {
+        size_t total = 0;
+        for (const auto& conn : conns) total += conn.sent.size();
+        return total;
+    }
+
+    uint32_t indexOf(const Conn& conn) const { return (uint32_t)(&conn - conns.data()); }
+
+    void open(Conn& conn) {
+        conn.in.clear();
+        conn.out.clear();
+        conn.out_offset = 0;
+        conn.sent.clear();
+        conn.connected = false;
+        if (Clock::now() >= stop_at) return;
+
+        conn.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int one = 1;
+        setsockopt(conn.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (connect(conn.fd, (const sockaddr*)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+            stats.connect_errors.fetch_add(1, std::memory_order_relaxed);
+            close(conn.fd);
+            conn.fd = -1;
+            return;
+        }
+
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+        ev.data.u32 = indexOf(conn);
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn.fd, &ev);
+    }
+
+    void reopen(Conn& conn) {
+        if (conn.fd >= 0) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn.fd, nullptr);
+            close(conn.fd);
+            conn.fd = -1;
+        }
+        open(conn);
+    }
+
+    void fill(Conn& conn) {
+        if (!conn.connected) {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(conn.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err != 0) {
+                stats.connect_errors.fetch_add(1, std::memory_order_relaxed);
+                reopen(conn);
+                return;
+            }
+            conn.connected = true;
+        }
+
+        auto now = Clock::now();
+        while (now < stop_at && conn.sent.size() < (size_t)opts.pipeline) {
+            const Scheduled& request = schedule[conn.next++ % schedule.size()];
+            conn.out += request.text;
+            conn.sent.push_back({now, request.head});
+        }
+
+        while (conn.out_offset < conn.out.size()) {
+            ssize_t n = send(conn.fd, conn.out.data() + conn.out_offset, conn.out.size() - conn.out_offset, MSG_NOSIGNAL);
+            if (n > 0) {
+                conn.out_offset += n;
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            fail(conn);
+            return;
+        }
+        if (conn.out_offset == conn.out.size()) {
+            conn.out.clear();
+            conn.out_offset = 0;
+        }
+
+        // Only wait for writability while there is something left to send.
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLRDHUP | (conn.out.empty() ? 0u : (uint32_t)EPOLLOUT);
+        ev.data.u32 = indexOf(conn);
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn.fd, &ev);
+    }
+
+    void fail(Conn& conn) {
+        stats.io_errors.fetch_add(1, std::memory_order_relaxed);
+        conn.sent.clear();
+        reopen(conn);
+    }
+
+    void readable(Conn& conn) {
+        char buffer[65536];
+        bool eof = false;
+        while (true) {
+            ssize_t n = recv(conn.fd, buffer, sizeof(buffer), 0);
+            if (n > 0) {
+                conn.in.append(buffer, n);
+                if (Clock::now() >= measure_from) stats.bytes.fetch_add(n, std::memory_order_relaxed);
+                continue;
+            }
+            if (n == 0) {
+                eof = true;
+                break;
+            }
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            fail(conn);
+            return;
+        }
+
+        bool close_after = false;
+        while (!conn.sent.empty()) {
+            int status = 0;
+            long used = parse_response(conn.in, conn.sent.front().head, eof, status, close_after);
+            if (used < 0) {
+                stats.parse_errors.fetch_add(1, std::memory_order_relaxed);
+                conn.sent.clear();
+                reopen(conn);
+                return;
+            }
+            if (used == 0) break;
+
+            // An interim response such as 100 Continue is followed by the real one.
+            if (status >= 100 && status < 200 && status != 101) {
+                conn.in.erase(0, used);
+                continue;
+            }
+
+            auto now = Clock::now();
+            if (now >= measure_from) {
+                uint64_t micros = std::chrono::duration_cast<std::chrono::microseconds>(now - conn.sent.front().at).count();
+                stats.latency.record(micros);
+                stats.requests.fetch_add(1, std::memory_order_relaxed);
+                stats.status[std::clamp(status / 100, 0, 5)].fetch_add(1, std::memory_order_relaxed);
+                uint64_t seen = stats.max_us.load(std::memory_order_relaxed);
+                while (micros > seen && !stats.max_us.compare_exchange_weak(seen, micros)) {}
+            }
+            conn.sent.pop_front();
+            conn.in.erase(0, used);
+
+            if (close_after || !opts.keep_alive) {
+                // Anything pipelined behind a closing response never gets an answer.
+                conn.sent.clear();
+                reopen(conn);
+                return;
+            }
+        }
+
+        if (eof) {
+            if (!conn.sent.empty()) stats.io_errors.fetch_add(1, std::memory_order_relaxed);
+            conn.sent.clear();
+            reopen(conn);
+            return;
+        }
+        fill(conn);
+    }
+};
+
+static string build_request(const RequestSpec& spec, const Options& opts) {
+    string host = opts.host + ":" + to_string(opts.port);
+    string text = spec.method + " " + spec.path + " HTTP/1.1\r\nHost: " + host + "\r\nUser-Agent: six_bench\r\n";
+    if (!opts.keep_alive) text += "Connection: close\r\n";
+    if (!spec.body.empty() || spec.method == "POST") {
+        text += "Content-Type: application/x-www-form-urlencoded\r\n";
+        text += "Content-Length: " + to_string(spec.body.size()) + "\r\n";
+    }
+    return text + "\r\n" + spec.body;
+}
+
+static string json_escape(const string& value) {
+    string out;
+    for (char c : value) {
+        if (c == '"' || c == '\\') out += '\\';
+        out += c;
+    }
+    return out;
+}
+
+int main(int argc, char** argv) {
+    Options opts;
+    if (!parse_options(argc, argv, opts)) return 2;
+
+    addrinfo hints{};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* resolved = nullptr;
+    if (getaddrinfo(opts.host.c_str(), nullptr, &hints, &resolved) != 0 || !resolved) {
+        cerr << "cannot resolve " << opts.host << "\n";
+        return 1;
+    }
+    sockaddr_in addr = *(sockaddr_in*)resolved->ai_addr;
+    addr.sin_port = htons(opts.port);
+    freeaddrinfo(resolved);
+
+    // Weighted round robin: each request appears `weight` times.
+    vector<Scheduled> schedule;
+    for (const auto& spec : opts.requests) {
+        Scheduled request{build_request(spec, opts), spec.method == "HEAD"};
+        for (int i = 0; i < spec.weight; ++i) schedule.push_back(request);
+    }
+
+    auto stats = std::make_unique<Stats>();
+    auto start = Clock::now();
+    auto measure_from = start + std::chrono::milliseconds((long)(opts.warmup * 1000));
+    auto stop_at = measure_from + std::chrono::milliseconds((long)(opts.duration * 1000));
+
+    cerr << "six_bench: " << opts.scenario << " on " << opts.host << ":" << opts.port << ", "
+         << opts.connections << " connections, " << opts.threads << " threads, pipeline " << opts.pipeline
+         << (opts.keep_alive ? "" : ", no keep-alive") << ", " << opts.duration << "s\n";
+
+    vector<std::unique_ptr<Worker>> workers;
+    vector<std::thread> threads;
+    for (int i = 0; i < opts.threads; ++i) {
+        int share = opts.connections / opts.threads + (i < opts.connections % opts.threads ? 1 : 0);
+        workers.push_back(std::make_unique<Worker>(opts, addr, schedule, *stats, share, measure_from, stop_at));
+    }
+    for (auto& worker : workers) {
+        threads.emplace_back([&worker] { worker->run(); });
+    }
+    for (auto& thread : threads) thread.join();
+
+    Histogram::Snapshot latency = stats->latency.snapshot();
+    uint64_t requests = stats->requests.load();
+    double mean_us = latency.count ? (double)latency.sum / latency.count : 0;
+
+    ostringstream json;
+    json << "{\n"
+         << "  \"scenario\": \"" << json_escape(opts.scenario) << "\",\n"
+         << "  \"connections\": " << opts.connections << ",\n"
+         << "  \"threads\": " << opts.threads << ",\n"
+         << "  \"pipeline\": " << opts.pipeline << ",\n"
+         << "  \"keep_alive\": " << (opts.keep_alive ? "true" : "false") << ",\n"
+         << "  \"duration_s\": " << opts.duration << ",\n"
+         << "  \"requests\": " << requests << ",\n"
+         << "  \"rps\": " << (uint64_t)(requests / opts.duration) << ",\n"
+         << "  \"bytes_read\": " << stats->bytes.load() << ",\n"
+         << "  \"latency_us\": {"
+         << "\"mean\": " << (uint64_t)mean_us
+         << ", \"p50\": " << latency.percentile(0.50)
+         << ", \"p90\": " << latency.percentile(0.90)
+         << ", \"p99\": " << latency.percentile(0.99)
+         << ", \"p999\": " << latency.percentile(0.999)
+         << ", \"max\": " << stats->max_us.load() << "},\n"
+         << "  \"status\": {"
+         << "\"2xx\": " << stats->status[2].load()
+         << ", \"3xx\": " << stats->status[3].load()
+         << ", \"4xx\": " << stats->status[4].load()
+         << ", \"5xx\": " << stats->status[5].load()
+         << ", \"other\": " << stats->status[0].load() + stats->status[1].load() << "},\n"
+         << "  \"errors\": {"
+         << "\"connect\": " << stats->connect_errors.load()
+         << ", \"io\": " << stats->io_errors.load()
+         << ", \"parse\": " << stats->parse_errors.load()
+         << ", \"unanswered\": " << stats->unanswered.load() << "}\n"
+         << "}\n";
+
+    if (opts.json_path.empty()) {
+        cout << json.str();
+    } else {
+        ofstream out(opts.json_path);
+        out << json.str();
+        cerr << "wrote " << opts.json_path << "\n";
+    }
+    return 0;
+}
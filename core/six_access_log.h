@@ -0,0 +1,395 @@
+#ifndef six_access_log_h
+#define six_access_log_h
+
+#include <string>
+#include <string_view>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <algorithm>
+#include <iostream>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <ctime>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+
+using namespace std;
+
+enum class LogFormat { Off, Common, Combined, Json };
+
+// Bounded multi-producer, single-consumer ring. Each cell carries a sequence
+// number that tells producers whether it is free and the consumer whether
+// it is filled, so neither side takes a lock. A full ring rejects the push.
+template <typename T>
+class MpscRing {
+public:
+    explicit MpscRing(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity) size <<= 1;
+        cells.reset(new Cell[size]);
+        mask = size - 1;
+        for (size_t i = 0; i < size; ++i) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    template <typename Fill>
+    bool push(Fill fill) {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells[pos & mask];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    fill(cell.value);
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Consumer only.
+    bool ready() const {
+        return cells[head & mask].sequence.load(std::memory_order_acquire) == head + 1;
+    }
+
+    // Consumer only.
+    template <typename Take>
+    bool pop(Take take) {
+        Cell& cell = cells[head & mask];
+        if (cell.sequence.load(std::memory_order_acquire) != head + 1) return false;
+        take(cell.value);
+        cell.sequence.store(head + mask + 1, std::memory_order_release);
+        head++;
+        return true;
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask = 0;
+    alignas(64) std::atomic<size_t> tail{0};
+    alignas(64) size_t head = 0;
+};
+
+struct AccessLogEntry {
+    std::string_view remote_addr;
+    std::string_view method;
+    std::string_view path;
+    std::string_view query;
+    std::string_view version;
+    std::string_view referer;
+    std::string_view user_agent;
+    int status = 0;
+    int64_t bytes = -1;
+    uint64_t duration_us = 0;
+};
+
+// Workers copy each request into a fixed-size record in the ring; a
+// background thread formats whatever has queued up and writes it with a
+// single write(). When the ring is full the record is dropped and counted
+// rather than making the worker wait. An idle writer blocks on an eventfd
+// that the next record's producer signals.
+class AccessLog {
+public:
+    static constexpr size_t RING_CAPACITY = 8192;
+    static constexpr size_t BATCH_BYTES = 256 * 1024;
+
+    AccessLog() = default;
+    AccessLog(const AccessLog&) = delete;
+    AccessLog& operator=(const AccessLog&) = delete;
+
+    ~AccessLog() {
+        stop.store(true, std::memory_order_release);
+        if (writer.joinable()) {
+            wake();
+            writer.join();
+        }
+        if (wake_fd >= 0) close(wake_fd);
+        if (fd > STDERR_FILENO) close(fd);
+    }
+
+    // An empty path logs to stdout. Call before start().
+    bool open(LogFormat log_format, const std::string& path) {
+        format = log_format;
+        if (path.empty()) return true;
+
+        int file = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (file < 0) {
+            perror("[ERROR] access log open");
+            return false;
+        }
+        if (fd > STDERR_FILENO) close(fd);
+        fd = file;
+        return true;
+    }
+
+    void start() {
+        if (format == LogFormat::Off || writer.joinable()) return;
+        wake_fd = eventfd(0, EFD_CLOEXEC);
+        if (wake_fd < 0) {
+            perror("[ERROR] access log eventfd");
+            return;
+        }
+        ring = std::make_unique<MpscRing<Record>>(RING_CAPACITY);
+        writer = std::thread([this] { run(); });
+    }
+
+    bool enabled() const { return ring != nullptr; }
+
+    void log(const AccessLogEntry& entry) {
+        if (!ring) return;
+
+        timespec now;
+        clock_gettime(CLOCK_REALTIME_COARSE, &now);
+        bool queued = ring->push([&](Record& record) {
+            record.time = now.tv_sec;
+            record.status = (uint16_t)entry.status;
+            record.bytes = entry.bytes;
+            record.duration_us = entry.duration_us;
+
+            size_t used = 0;
+            std::string_view fields[FIELD_COUNT] = {
+                entry.remote_addr, entry.method, entry.path, entry.query,
+                entry.version, entry.referer, entry.user_agent,
+            };
+            for (size_t i = 0; i < FIELD_COUNT; ++i) {
+                size_t n = std::min(fields[i].size(), Record::TEXT_SIZE - used);
+                // Cut before a UTF-8 sequence rather than through it.
+                while (n > 0 && n < fields[i].size() && ((unsigned char)fields[i][n] & 0xc0) == 0x80) n--;
+                if (n > 0) memcpy(record.text + used, fields[i].data(), n); // empty views may be null
+                record.lengths[i] = (uint16_t)n;
+                used += n;
+            }
+        });
+        if (!queued) {
+            dropped_records.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        // Pairs with the fence in run(): either the writer sees this record
+        // before it blocks, or this sees it asleep and wakes it.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping.load(std::memory_order_relaxed) && sleeping.exchange(false, std::memory_order_relaxed)) {
+            wake();
+        }
+    }
+
+    uint64_t dropped() const {
+        return dropped_records.load(std::memory_order_relaxed);
+    }
+
+private:
+    enum Field { RemoteAddr, Method, Path, Query, Version, Referer, UserAgent, FIELD_COUNT };
+
+    struct Record {
+        static constexpr size_t TEXT_SIZE = 464;
+
+        time_t time;
+        int64_t bytes;
+        uint64_t duration_us;
+        uint16_t status;
+        uint16_t lengths[FIELD_COUNT];
+        char text[TEXT_SIZE];
+
+        std::string_view field(Field which) const {
+            size_t offset = 0;
+            for (int i = 0; i < which; ++i) offset += lengths[i];
+            return std::string_view(text + offset, lengths[which]);
+        }
+    };
+
+    std::unique_ptr<MpscRing<Record>> ring;
+    std::atomic<uint64_t> dropped_records{0};
+    std::atomic<bool> stop{false};
+    std::atomic<bool> sleeping{false};
+    int wake_fd = -1;
+    std::thread writer;
+    LogFormat format = LogFormat::Common;
+    int fd = STDOUT_FILENO;
+
+    // Formatting a timestamp costs more than the rest of the line, and
+    // records arrive in bursts from the same second.
+    time_t cached_second = -1;
+    char cached_time[64] = {};
+
+    void run() {
+        std::string batch;
+        batch.reserve(BATCH_BYTES + 4096);
+
+        while (true) {
+            bool stopping = stop.load(std::memory_order_acquire);
+            while (batch.size() < BATCH_BYTES && ring->pop([&](const Record& record) { append(record, batch); })) {}
+
+            if (!batch.empty()) {
+                writeAll(batch);
+                batch.clear();
+                continue;
+            }
+            if (stopping) return;
+
+            sleeping.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!ring->ready() && !stop.load(std::memory_order_acquire)) {
+                uint64_t count;
+                while (::read(wake_fd, &count, sizeof(count)) < 0 && errno == EINTR) {}
+            }
+            sleeping.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    void wake() {
+        uint64_t one = 1;
+        while (::write(wake_fd, &one, sizeof(one)) < 0 && errno == EINTR) {}
+    }
+
+    void writeAll(const std::string& data) {
+        size_t offset = 0;
+        while (offset < data.size()) {
+            ssize_t n = ::write(fd, data.data() + offset, data.size() - offset);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return;
+            }
+            offset += n;
+        }
+    }
+
+    const char* timestamp(time_t second) {
+        if (second != cached_second) {
+            tm local;
+            localtime_r(&second, &local);
+            const char* pattern = format == LogFormat::Json ? "%Y-%m-%dT%H:%M:%S%z" : "%d/%b/%Y:%H:%M:%S %z";
+            strftime(cached_time, sizeof(cached_time), pattern, &local);
+            cached_second = second;
+        }
+        return cached_time;
+    }
+
+    // Length of the well-formed UTF-8 sequence at `s[i]`, or 0 if there is
+    // none: no overlong forms, surrogates or code points past U+10FFFF.
+    static size_t utf8Sequence(std::string_view s, size_t i) {
+        unsigned char lead = (unsigned char)s[i];
+        size_t length;
+        unsigned char low = 0x80, high = 0xbf; // range of the second byte
+        if (lead >= 0xc2 && lead <= 0xdf) length = 2;
+        else if (lead >= 0xe0 && lead <= 0xef) {
+            length = 3;
+            if (lead == 0xe0) low = 0xa0;
+            if (lead == 0xed) high = 0x9f;
+        } else if (lead >= 0xf0 && lead <= 0xf4) {
+            length = 4;
+            if (lead == 0xf0) low = 0x90;
+            if (lead == 0xf4) high = 0x8f;
+        } else {
+            return 0;
+        }
+        if (i + length > s.size()) return 0;
+
+        unsigned char second = (unsigned char)s[i + 1];
+        if (second < low || second > high) return 0;
+        for (size_t k = 2; k < length; ++k) {
+            if (((unsigned char)s[i + k] & 0xc0) != 0x80) return 0;
+        }
+        return length;
+    }
+
+    // JSON keeps well-formed UTF-8 and writes any other byte as \u00XX, so
+    // the line stays valid JSON; the text formats escape every byte >= 0x80.
+    static void appendEscaped(std::string& out, std::string_view value, bool json) {
+        static const char* digits = "0123456789abcdef";
+        for (size_t i = 0; i < value.size(); ++i) {
+            char c = value[i];
+            unsigned char u = (unsigned char)c;
+            size_t sequence = json && u >= 0x80 ? utf8Sequence(value, i) : 0;
+            if (sequence > 0) {
+                out.append(value.substr(i, sequence));
+                i += sequence - 1;
+            } else if (c == '"' || c == '\\') {
+                out += '\\';
+                out += c;
+            } else if (u < 0x20 || u >= 0x7f) {
+                out += json ? "\\u00" : "\\x";
+                out += digits[u >> 4];
+                out += digits[u & 15];
+            } else {
+                out += c;
+            }
+        }
+    }
+
+    void append(const Record& record, std::string& out) {
+        if (format == LogFormat::Json) {
+            appendJson(record, out);
+            return;
+        }
+
+        // host - - [time] "request" status bytes
+        out.append(record.field(RemoteAddr));
+        out += " - - [";
+        out += timestamp(record.time);
+        out += "] \"";
+        appendEscaped(out, record.field(Method), false);
+        out += ' ';
+        appendEscaped(out, record.field(Path), false);
+        if (record.lengths[Query] > 0) {
+            out += '?';
+            appendEscaped(out, record.field(Query), false);
+        }
+        out += ' ';
+        appendEscaped(out, record.field(Version), false);
+        out += "\" ";
+        out += std::to_string(record.status);
+        out += ' ';
+        out += record.bytes >= 0 ? std::to_string(record.bytes) : "-";
+
+        if (format == LogFormat::Combined) {
+            out += " \"";
+            appendEscaped(out, record.lengths[Referer] ? record.field(Referer) : "-", false);
+            out += "\" \"";
+            appendEscaped(out, record.lengths[UserAgent] ? record.field(UserAgent) : "-", false);
+            out += '"';
+        }
+        out += '\n';
+    }
+
+    void appendJson(const Record& record, std::string& out) {
+        static const char* keys[FIELD_COUNT] = {
+            "remote_addr", "method", "path", "query", "version", "referer", "user_agent",
+        };
+
+        out += "{\"time\":\"";
+        out += timestamp(record.time);
+        out += '"';
+        for (int i = 0; i < FIELD_COUNT; ++i) {
+            out += ",\"";
+            out += keys[i];
+            out += "\":\"";
+            appendEscaped(out, record.field((Field)i), true);
+            out += '"';
+        }
+        out += ",\"status\":";
+        out += std::to_string(record.status);
+        out += ",\"bytes\":";
+        out += record.bytes >= 0 ? std::to_string(record.bytes) : "null";
+        out += ",\"duration_us\":";
+        out += std::to_string(record.duration_us);
+        out += "}\n";
+    }
+};
+
+#endif
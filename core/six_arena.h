@@ -0,0 +1,122 @@
+#ifndef six_arena_h
+#define six_arena_h
+
+#include <memory_resource>
+#include <memory>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+#include <new>
+
+using namespace std;
+
+// Monotonic bump allocator for request-lifetime memory. Deallocation is a
+// no-op; everything is released at once by reset(), which keeps a few
+// chunks around for the next request to reuse.
+class Arena : public std::pmr::memory_resource {
+public:
+    static constexpr size_t CHUNK_SIZE = 64 * 1024;
+    static constexpr size_t MAX_RETAINED_CHUNKS = 4;
+
+    Arena() = default;
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    ~Arena() { releaseLarge(); }
+
+    void reset() {
+        releaseLarge();
+        if (chunks.size() > MAX_RETAINED_CHUNKS) {
+            chunks.resize(MAX_RETAINED_CHUNKS);
+        }
+        chunk = 0;
+        offset = 0;
+        used_bytes = 0;
+    }
+
+    size_t used() const { return used_bytes; }
+
+    std::string_view copy(std::string_view text) {
+        if (text.empty()) return {};
+        char* data = static_cast<char*>(allocate(text.size(), 1));
+        memcpy(data, text.data(), text.size());
+        return std::string_view(data, text.size());
+    }
+
+protected:
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        used_bytes += bytes;
+
+        if (bytes > CHUNK_SIZE / 4) {
+            size_t align = std::max(alignment, alignof(std::max_align_t));
+            void* data = ::operator new(bytes, std::align_val_t(align));
+            large.emplace_back(data, align);
+            return data;
+        }
+
+        while (true) {
+            if (chunk < chunks.size()) {
+                uintptr_t base = reinterpret_cast<uintptr_t>(chunks[chunk].get());
+                uintptr_t aligned = (base + offset + alignment - 1) & ~(uintptr_t)(alignment - 1);
+                if (aligned + bytes <= base + CHUNK_SIZE) {
+                    offset = aligned + bytes - base;
+                    return reinterpret_cast<void*>(aligned);
+                }
+                if (offset > 0) {
+                    chunk++;
+                    offset = 0;
+                    continue;
+                }
+            }
+            chunks.emplace_back(new char[CHUNK_SIZE]);
+            chunk = chunks.size() - 1;
+            offset = 0;
+        }
+    }
+
+    void do_deallocate(void*, size_t, size_t) override {}
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+private:
+    std::vector<std::unique_ptr<char[]>> chunks;
+    std::vector<std::pair<void*, size_t>> large;
+    size_t chunk = 0;
+    size_t offset = 0;
+    size_t used_bytes = 0;
+
+    void releaseLarge() {
+        for (auto& [data, align] : large) {
+            ::operator delete(data, std::align_val_t(align));
+        }
+        large.clear();
+    }
+};
+
+inline Arena*& current_arena() {
+    thread_local Arena* arena = nullptr;
+    return arena;
+}
+
+inline Arena& thread_arena() {
+    thread_local Arena arena;
+    return arena;
+}
+
+// Scratch memory that lives until the current request's response has been
+// handed to the server. Use it through std::pmr containers:
+//   std::pmr::vector<int> ids(&request_arena());
+// The server keeps only route match results and the read buffer for
+// compressing static files here. Everything else a request allocates,
+// including the regex engine's state, comes from the heap.
+inline Arena& request_arena() {
+    Arena* arena = current_arena();
+    return arena ? *arena : thread_arena();
+}
+
+#endif
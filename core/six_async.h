@@ -0,0 +1,295 @@
+#ifndef six_async_h
+#define six_async_h
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+
+#include <coroutine>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <queue>
+#include <type_traits>
+#include <utility>
+#include "six_http_server.h"
+
+using namespace std;
+
+// The signed-in user, kept per worker by six_login.h. An async handler holds
+// its own copy and swaps it in while it runs.
+struct CurrentUser;
+std::shared_ptr<CurrentUser> save_current_user();
+void swap_current_user(CurrentUser& user);
+
+inline void resume_on(ThreadPool* pool, std::coroutine_handle<> h) {
+    if (pool) {
+        pool->enqueue([h] { h.resume(); });
+    } else {
+        h.resume();
+    }
+}
+
+inline ThreadPool& blocking_pool() {
+    static ThreadPool pool(std::max(4u, std::thread::hardware_concurrency()));
+    return pool;
+}
+
+class AsyncTimers {
+public:
+    using clock = std::chrono::steady_clock;
+
+    static AsyncTimers& instance() {
+        static AsyncTimers timers;
+        return timers;
+    }
+
+    void schedule(clock::time_point when, std::coroutine_handle<> h, ThreadPool* pool) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            entries.push({when, h, pool});
+        }
+        cv.notify_one();
+    }
+
+    ~AsyncTimers() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv.notify_one();
+        if (worker.joinable()) worker.join();
+    }
+
+private:
+    struct Entry {
+        clock::time_point when;
+        std::coroutine_handle<> handle;
+        ThreadPool* pool;
+
+        bool operator>(const Entry& other) const { return when > other.when; }
+    };
+
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> entries;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stop = false;
+    std::thread worker;
+
+    AsyncTimers() : worker([this] { run(); }) {}
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stop) {
+            if (entries.empty()) {
+                cv.wait(lock);
+                continue;
+            }
+            if (entries.top().when > clock::now()) {
+                cv.wait_until(lock, entries.top().when);
+                continue;
+            }
+            Entry due = entries.top();
+            entries.pop();
+            lock.unlock();
+            resume_on(due.pool, due.handle);
+            lock.lock();
+        }
+    }
+};
+
+class async_response {
+public:
+    struct promise_type;
+
+    // Wraps every co_await in an async handler. A resumed handler may be on
+    // another worker, so the current request, response and arena are set
+    // there first, along with the signed-in user, and cleared from the thread
+    // it leaves.
+    template <typename Awaiter>
+    struct resuming {
+        Awaiter inner;
+        promise_type* promise;
+        bool left = false;
+
+        bool await_ready() { return inner.await_ready(); }
+
+        // The handler may be resumed elsewhere before the inner await_suspend()
+        // returns, so nothing of the promise is touched after it.
+        template <typename Handle>
+        auto await_suspend(Handle h) {
+            promise->leave();
+            left = true;
+            try {
+                return inner.await_suspend(h);
+            } catch(...) {
+                promise->enter();
+                left = false;
+                throw;
+            }
+        }
+
+        decltype(auto) await_resume() {
+            if (left) promise->enter();
+            return inner.await_resume();
+        }
+    };
+
+    struct promise_type {
+        http_response result;
+        std::exception_ptr error;
+        std::function<void(http_response)> done;
+        http_request* request = nullptr;
+        Arena* arena = nullptr;
+        std::shared_ptr<CurrentUser> user;
+
+        // Helpers write response headers into `result`, as they write into
+        // the response of a plain handler; the returned response replaces it.
+        void enter() {
+            g_current_request = request;
+            g_current_response = &result;
+            current_arena() = arena;
+            swap_current_user(*user);
+        }
+
+        void leave() {
+            swap_current_user(*user);
+            g_current_request = nullptr;
+            g_current_response = nullptr;
+            current_arena() = nullptr;
+        }
+
+        template <typename Awaiter>
+        resuming<std::decay_t<Awaiter>> await_transform(Awaiter&& awaiter) {
+            return {std::forward<Awaiter>(awaiter), this};
+        }
+
+        async_response get_return_object() {
+            return async_response(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        auto final_suspend() noexcept {
+            struct finisher {
+                bool await_ready() noexcept { return false; }
+
+                void await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+                    promise_type& promise = h.promise();
+                    promise.leave();
+                    auto done = std::move(promise.done);
+                    http_response res = std::move(promise.result);
+
+                    if (promise.error) {
+                        try {
+                            std::rethrow_exception(promise.error);
+                        } catch(const std::exception& e) {
+                            cerr << "[ERROR] Async handler exception: " << e.what() << endl;
+                        } catch(...) {
+                            cerr << "[ERROR] Unknown async handler exception" << endl;
+                        }
+                        res = http_response("<h1>" + string(status_reason(500)) + "</h1>");
+                        res.status = 500;
+                    }
+
+                    h.destroy();
+                    if (done) done(std::move(res));
+                }
+
+                void await_resume() noexcept {}
+            };
+            return finisher{};
+        }
+
+        void return_value(http_response res) { result = std::move(res); }
+        void return_value(const std::string& body) { result = http_response(body); }
+        void unhandled_exception() { error = std::current_exception(); }
+    };
+
+    async_response(async_response&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    async_response(const async_response&) = delete;
+    async_response& operator=(const async_response&) = delete;
+
+    ~async_response() {
+        if (handle) handle.destroy();
+    }
+
+    // Runs the handler up to its first suspension on the calling worker,
+    // which has the request and its arena current.
+    void start(std::function<void(http_response)> done) {
+        auto h = std::exchange(handle, nullptr);
+        promise_type& promise = h.promise();
+        promise.done = std::move(done);
+        promise.request = g_current_request;
+        promise.arena = current_arena();
+        promise.user = save_current_user();
+        promise.enter();
+        h.resume();
+    }
+
+private:
+    std::coroutine_handle<promise_type> handle;
+
+    explicit async_response(std::coroutine_handle<promise_type> h) : handle(h) {}
+};
+
+template <typename F>
+auto run_blocking(F fn) {
+    using R = std::invoke_result_t<F>;
+    using Stored = std::conditional_t<std::is_void_v<R>, bool, R>;
+
+    struct awaiter {
+        F fn;
+        std::optional<Stored> result;
+        std::exception_ptr error;
+
+        bool await_ready() { return false; }
+
+        void await_suspend(std::coroutine_handle<> h) {
+            ThreadPool* pool = ThreadPool::current();
+            blocking_pool().enqueue([this, h, pool] {
+                try {
+                    if constexpr (std::is_void_v<R>) {
+                        fn();
+                        result.emplace(true);
+                    } else {
+                        result.emplace(fn());
+                    }
+                } catch(...) {
+                    error = std::current_exception();
+                }
+                resume_on(pool, h);
+            });
+        }
+
+        R await_resume() {
+            if (error) std::rethrow_exception(error);
+            if constexpr (!std::is_void_v<R>) {
+                return std::move(*result);
+            }
+        }
+    };
+
+    return awaiter{std::move(fn), std::nullopt, nullptr};
+}
+
+template <typename Rep, typename Period>
+auto sleep_for(std::chrono::duration<Rep, Period> duration) {
+    struct awaiter {
+        AsyncTimers::clock::time_point when;
+
+        bool await_ready() { return when <= AsyncTimers::clock::now(); }
+
+        void await_suspend(std::coroutine_handle<> h) {
+            AsyncTimers::instance().schedule(when, h, ThreadPool::current());
+        }
+
+        void await_resume() {}
+    };
+
+    return awaiter{AsyncTimers::clock::now()
+        + std::chrono::duration_cast<AsyncTimers::clock::duration>(duration)};
+}
+
+#endif
+
+#endif
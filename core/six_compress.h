@@ -0,0 +1,176 @@
+#ifndef six_compress_h
+#define six_compress_h
+
+#include <string>
+#include <string_view>
+#include <memory>
+#include <climits>
+#include <cctype>
+#include <ctime>
+#include <cstdlib>
+
+#if __has_include(<zlib.h>)
+#include <zlib.h>
+#define SIX_HAS_ZLIB 1
+#endif
+
+#include "six_lru_cache.h"
+
+using namespace std;
+
+enum class Encoding { Identity, Gzip, Deflate };
+
+inline const char* encoding_name(Encoding encoding) {
+    switch (encoding) {
+        case Encoding::Gzip: return "gzip";
+        case Encoding::Deflate: return "deflate";
+        default: return "identity";
+    }
+}
+
+// Picks gzip over deflate from an Accept-Encoding header, honouring q=0.
+// "*" stands only for codings the header doesn't name, so "gzip;q=0, *"
+// refuses gzip.
+inline Encoding negotiate_encoding(std::string_view accept) {
+#ifdef SIX_HAS_ZLIB
+    enum Verdict { Unlisted, Accepted, Refused };
+    Verdict gzip = Unlisted;
+    Verdict deflate = Unlisted;
+    Verdict any = Unlisted;
+
+    size_t pos = 0;
+    while (pos < accept.size()) {
+        size_t end = accept.find(',', pos);
+        if (end == std::string_view::npos) end = accept.size();
+        std::string_view item = accept.substr(pos, end - pos);
+        pos = end + 1;
+
+        size_t semi = item.find(';');
+        std::string name(item.substr(0, semi));
+        name.erase(0, name.find_first_not_of(" \t"));
+        name.erase(name.find_last_not_of(" \t") + 1);
+        for (auto& c : name) c = (char)tolower((unsigned char)c);
+
+        Verdict verdict = Accepted;
+        if (semi != std::string_view::npos) {
+            size_t q = item.find("q=", semi);
+            if (q != std::string_view::npos && strtod(std::string(item.substr(q + 2)).c_str(), nullptr) <= 0) {
+                verdict = Refused;
+            }
+        }
+
+        if (name == "gzip" || name == "x-gzip") gzip = verdict;
+        else if (name == "deflate") deflate = verdict;
+        else if (name == "*") any = verdict;
+    }
+
+    if (gzip == Unlisted) gzip = any;
+    if (deflate == Unlisted) deflate = any;
+    if (gzip == Accepted) return Encoding::Gzip;
+    if (deflate == Accepted) return Encoding::Deflate;
+#endif
+    return Encoding::Identity;
+}
+
+#ifdef SIX_HAS_ZLIB
+// One deflate stream per encoding and thread, reset between bodies so the
+// window and hash tables are allocated once instead of per response.
+class Deflater {
+public:
+    ~Deflater() {
+        for (auto& slot : slots) {
+            if (slot.ready) deflateEnd(&slot.stream);
+        }
+    }
+
+    bool compress(std::string_view in, std::string& out, Encoding encoding, int level) {
+        if (encoding == Encoding::Identity || in.size() > UINT_MAX) return false;
+
+        Slot& slot = slots[encoding == Encoding::Gzip ? 0 : 1];
+        if (!slot.ready) {
+            int bits = encoding == Encoding::Gzip ? 15 + 16 : 15;
+            if (deflateInit2(&slot.stream, level, Z_DEFLATED, bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+            slot.ready = true;
+            slot.level = level;
+        } else {
+            deflateReset(&slot.stream);
+            if (slot.level != level) {
+                deflateParams(&slot.stream, level, Z_DEFAULT_STRATEGY);
+                slot.level = level;
+            }
+        }
+
+        z_stream& zs = slot.stream;
+        out.resize(deflateBound(&zs, in.size()));
+        zs.next_in = (Bytef*)in.data();
+        zs.avail_in = (uInt)in.size();
+        zs.next_out = (Bytef*)out.data();
+        zs.avail_out = (uInt)out.size();
+
+        int rc = deflate(&zs, Z_FINISH);
+        out.resize(zs.total_out);
+        return rc == Z_STREAM_END;
+    }
+
+    static Deflater& local() {
+        thread_local Deflater deflater;
+        return deflater;
+    }
+
+private:
+    struct Slot {
+        z_stream stream{};
+        bool ready = false;
+        int level = 0;
+    };
+
+    Slot slots[2];
+};
+#endif
+
+inline bool compress_body(std::string_view in, std::string& out, Encoding encoding, int level) {
+#ifdef SIX_HAS_ZLIB
+    return Deflater::local().compress(in, out, encoding, level);
+#else
+    return false;
+#endif
+}
+
+// Compressed copies of static files, keyed by path and encoding and checked
+// against the file's size and mtime so edits are picked up. Least recently
+// used entries are evicted once the total passes the memory cap.
+class CompressedCache {
+public:
+    CompressedCache(size_t max_bytes = 32 * 1024 * 1024) : cache(max_bytes) {}
+
+    std::shared_ptr<const std::string> get(const std::string& path, Encoding encoding, size_t size, time_t mtime) {
+        Entry entry;
+        bool found = cache.get(key(path, encoding), entry, [&](const Entry& e) {
+            return e.size == size && e.mtime == mtime;
+        });
+        return found ? entry.data : nullptr;
+    }
+
+    void put(const std::string& path, Encoding encoding, size_t size, time_t mtime,
+             std::shared_ptr<const std::string> data) {
+        size_t bytes = data->size();
+        cache.put(key(path, encoding), {size, mtime, std::move(data)}, bytes);
+    }
+
+    void setMaxBytes(size_t bytes) { cache.setMaxBytes(bytes); }
+
+private:
+    struct Entry {
+        size_t size = 0;
+        time_t mtime = 0;
+        std::shared_ptr<const std::string> data;
+    };
+
+    LruCache<Entry> cache;
+
+    static std::string key(const std::string& path, Encoding encoding) {
+        return path + '\0' + encoding_name(encoding);
+    }
+};
+
+#endif
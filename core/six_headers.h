@@ -0,0 +1,302 @@
+#ifndef six_headers_h
+#define six_headers_h
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <utility>
+#include <stdexcept>
+#include <cstdint>
+#include <cstddef>
+
+using namespace std;
+
+// A view into the request bytes. It converts to std::string on demand so
+// code written against the old owning fields keeps compiling.
+class StrView : public std::string_view {
+public:
+    using std::string_view::string_view;
+    StrView(std::string_view view) : std::string_view(view) {}
+
+    StrView substr(size_type pos = 0, size_type count = npos) const {
+        return std::string_view::substr(pos, count);
+    }
+
+    std::string str() const { return std::string(data(), size()); }
+    operator std::string() const { return str(); }
+};
+
+inline std::string operator+(StrView a, StrView b) { return a.str().append(b); }
+inline std::string operator+(StrView a, const std::string& b) { return a.str().append(b); }
+inline std::string operator+(const std::string& a, StrView b) { return std::string(a).append(b); }
+inline std::string operator+(StrView a, const char* b) { return a.str().append(b); }
+inline std::string operator+(const char* a, StrView b) { return std::string(a).append(b); }
+inline std::string operator+(StrView a, char b) { return a.str() + b; }
+inline std::string operator+(char a, StrView b) { return std::string(1, a).append(b); }
+
+enum class Header : uint8_t {
+    Host,
+    Connection,
+    ContentLength,
+    ContentType,
+    TransferEncoding,
+    Expect,
+    Accept,
+    AcceptEncoding,
+    AcceptLanguage,
+    UserAgent,
+    Cookie,
+    Authorization,
+    Referer,
+    Origin,
+    CacheControl,
+    Pragma,
+    Range,
+    IfNoneMatch,
+    IfModifiedSince,
+    Upgrade,
+    XForwardedFor,
+    XForwardedProto,
+    XRealIp,
+    XRequestedWith,
+    Count
+};
+
+constexpr size_t HEADER_COUNT = (size_t)Header::Count;
+
+constexpr std::string_view HEADER_NAMES[HEADER_COUNT] = {
+    "Host",
+    "Connection",
+    "Content-Length",
+    "Content-Type",
+    "Transfer-Encoding",
+    "Expect",
+    "Accept",
+    "Accept-Encoding",
+    "Accept-Language",
+    "User-Agent",
+    "Cookie",
+    "Authorization",
+    "Referer",
+    "Origin",
+    "Cache-Control",
+    "Pragma",
+    "Range",
+    "If-None-Match",
+    "If-Modified-Since",
+    "Upgrade",
+    "X-Forwarded-For",
+    "X-Forwarded-Proto",
+    "X-Real-IP",
+    "X-Requested-With",
+};
+
+constexpr char ascii_lower(char c) {
+    return c >= 'A' && c <= 'Z' ? (char)(c + ('a' - 'A')) : c;
+}
+
+constexpr bool iequals(std::string_view a, std::string_view b) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (ascii_lower(a[i]) != ascii_lower(b[i])) return false;
+    }
+    return true;
+}
+
+// Perfect hash over the well-known header names: a case-insensitive FNV-1a
+// whose seed is searched at compile time until every name lands in its own
+// slot of TABLE_SIZE.
+namespace header_hash {
+
+constexpr size_t TABLE_SIZE = 64;
+
+constexpr uint32_t hash(std::string_view name, uint32_t seed) {
+    uint32_t h = 2166136261u ^ seed;
+    for (char c : name) {
+        h = (h ^ (uint8_t)ascii_lower(c)) * 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+constexpr bool collides(uint32_t seed) {
+    bool used[TABLE_SIZE] = {};
+    for (std::string_view name : HEADER_NAMES) {
+        size_t slot = hash(name, seed) % TABLE_SIZE;
+        if (used[slot]) return true;
+        used[slot] = true;
+    }
+    return false;
+}
+
+constexpr uint32_t findSeed() {
+    uint32_t seed = 0;
+    while (collides(seed)) seed++;
+    return seed;
+}
+
+constexpr uint32_t SEED = findSeed();
+
+struct Table {
+    uint8_t slots[TABLE_SIZE] = {};
+};
+
+constexpr Table buildTable() {
+    Table table{};
+    for (size_t i = 0; i < TABLE_SIZE; ++i) table.slots[i] = (uint8_t)HEADER_COUNT;
+    for (size_t i = 0; i < HEADER_COUNT; ++i) {
+        table.slots[hash(HEADER_NAMES[i], SEED) % TABLE_SIZE] = (uint8_t)i;
+    }
+    return table;
+}
+
+constexpr Table TABLE = buildTable();
+
+}  // namespace header_hash
+
+// Header::Count if `name` is not one of the well-known headers.
+constexpr Header lookup_header(std::string_view name) {
+    uint8_t index = header_hash::TABLE.slots[header_hash::hash(name, header_hash::SEED) % header_hash::TABLE_SIZE];
+    if (index < HEADER_COUNT && iequals(HEADER_NAMES[index], name)) return (Header)index;
+    return Header::Count;
+}
+
+static_assert(lookup_header("content-length") == Header::ContentLength, "header hash is not perfect");
+static_assert(lookup_header("X-Not-A-Header") == Header::Count, "header hash is not perfect");
+
+// Headers whose value is not a list, so a second, different copy can't be
+// folded into the first.
+constexpr bool singleton_header(Header header) {
+    switch (header) {
+        case Header::Host:
+        case Header::ContentLength:
+        case Header::ContentType:
+        case Header::Authorization:
+        case Header::Referer:
+        case Header::Origin:
+        case Header::Range:
+        case Header::IfModifiedSince:
+        case Header::XRealIp:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Request headers in arrival order. Names compare case-insensitively;
+// well-known headers are found through a fixed slot per Header, anything
+// else by scanning the (short) list.
+class HeaderMap {
+public:
+    using value_type = std::pair<StrView, StrView>;
+    using const_iterator = std::vector<value_type>::const_iterator;
+    using iterator = const_iterator;
+
+    const_iterator begin() const { return entries.begin(); }
+    const_iterator end() const { return entries.end(); }
+    size_t size() const { return entries.size(); }
+    bool empty() const { return entries.empty(); }
+
+    const_iterator find(Header header) const {
+        uint16_t slot = known[(size_t)header];
+        return slot ? entries.begin() + (slot - 1) : entries.end();
+    }
+
+    const_iterator find(std::string_view name) const {
+        Header header = lookup_header(name);
+        if (header != Header::Count) return find(header);
+
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            if (iequals(it->first, name)) return it;
+        }
+        return entries.end();
+    }
+
+    template <typename Key>
+    size_t count(const Key& name) const {
+        return find(name) != end() ? 1 : 0;
+    }
+
+    template <typename Key>
+    StrView at(const Key& name) const {
+        auto it = find(name);
+        if (it == end()) throw std::out_of_range("header not found");
+        return it->second;
+    }
+
+    template <typename Key>
+    StrView get(const Key& name) const {
+        auto it = find(name);
+        return it != end() ? it->second : StrView();
+    }
+
+    // Adds one header line. A repeated name is folded into the first
+    // occurrence, joined with ", " ("; " for Cookie) as RFC 9110 5.3 allows.
+    // False for a second, different value of a singleton_header().
+    bool add(StrView name, StrView value) {
+        Header header = lookup_header(name);
+        auto it = header != Header::Count ? find(header) : find(name);
+        if (it == entries.end()) {
+            entries.emplace_back(name, value);
+            if (header != Header::Count) {
+                known[(size_t)header] = (uint16_t)entries.size();
+            }
+            return true;
+        }
+
+        StrView& existing = entries[it - entries.begin()].second;
+        if (header != Header::Count && singleton_header(header)) return existing == value;
+        if (value.empty()) return true;
+        if (existing.empty()) {
+            existing = value;
+            return true;
+        }
+
+        // The joined value can't live in the request buffer, so it is kept
+        // here and shared by copies of the map, the way the buffer is.
+        if (!joined) joined = std::make_shared<std::deque<std::string>>();
+        std::string& combined = joined->emplace_back(existing);
+        combined += header == Header::Cookie ? "; " : ", ";
+        combined += value;
+        existing = StrView(combined);
+        return true;
+    }
+
+    // A repeated header replaces the earlier value.
+    void set(StrView name, StrView value) {
+        Header header = lookup_header(name);
+        auto it = header != Header::Count ? find(header) : find(name);
+        if (it != entries.end()) {
+            entries[it - entries.begin()].second = value;
+            return;
+        }
+
+        entries.emplace_back(name, value);
+        if (header != Header::Count) {
+            known[(size_t)header] = (uint16_t)entries.size();
+        }
+    }
+
+    void rebase(const char* from, const char* to) {
+        for (auto& [name, value] : entries) {
+            name = StrView(to + (name.data() - from), name.size());
+            if (!isJoined(value)) value = StrView(to + (value.data() - from), value.size());
+        }
+    }
+
+private:
+    std::vector<value_type> entries;
+    uint16_t known[HEADER_COUNT] = {};
+    std::shared_ptr<std::deque<std::string>> joined; // values folded by add()
+
+    bool isJoined(StrView value) const {
+        if (!joined) return false;
+        for (const auto& text : *joined) {
+            if (value.data() == text.data()) return true;
+        }
+        return false;
+    }
+};
+
+#endif
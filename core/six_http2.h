@@ -0,0 +1,1060 @@
+#ifndef six_http2_h
+#define six_http2_h
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <map>
+#include <utility>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+
+using namespace std;
+
+constexpr std::string_view H2_PREFACE = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+enum class H2Frame : uint8_t {
+    Data, Headers, Priority, RstStream, Settings, PushPromise, Ping, GoAway, WindowUpdate, Continuation
+};
+
+constexpr uint8_t H2_END_STREAM = 0x1;
+constexpr uint8_t H2_ACK = 0x1;
+constexpr uint8_t H2_END_HEADERS = 0x4;
+constexpr uint8_t H2_PADDED = 0x8;
+constexpr uint8_t H2_PRIORITY = 0x20;
+
+enum class H2Error : uint32_t {
+    NoError, Protocol, Internal, FlowControl, SettingsTimeout, StreamClosed,
+    FrameSize, RefusedStream, Cancel, Compression, Connect, EnhanceYourCalm,
+};
+
+enum class H2Setting : uint16_t {
+    HeaderTableSize = 1, EnablePush, MaxConcurrentStreams, InitialWindowSize, MaxFrameSize, MaxHeaderListSize
+};
+
+struct HpackField {
+    std::string name;
+    std::string value;
+};
+
+// RFC 7541, Appendix A. Index 0 is unused.
+constexpr std::string_view HPACK_STATIC_TABLE[62][2] = {
+    {"", ""},
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"}, {":path", "/index.html"},
+    {":scheme", "http"}, {":scheme", "https"}, {":status", "200"}, {":status", "204"}, {":status", "206"},
+    {":status", "304"}, {":status", "400"}, {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"}, {"accept-language", ""}, {"accept-ranges", ""}, {"accept", ""},
+    {"access-control-allow-origin", ""}, {"age", ""}, {"allow", ""}, {"authorization", ""},
+    {"cache-control", ""}, {"content-disposition", ""}, {"content-encoding", ""}, {"content-language", ""},
+    {"content-length", ""}, {"content-location", ""}, {"content-range", ""}, {"content-type", ""},
+    {"cookie", ""}, {"date", ""}, {"etag", ""}, {"expect", ""}, {"expires", ""}, {"from", ""}, {"host", ""},
+    {"if-match", ""}, {"if-modified-since", ""}, {"if-none-match", ""}, {"if-range", ""},
+    {"if-unmodified-since", ""}, {"last-modified", ""}, {"link", ""}, {"location", ""}, {"max-forwards", ""},
+    {"proxy-authenticate", ""}, {"proxy-authorization", ""}, {"range", ""}, {"referer", ""}, {"refresh", ""},
+    {"retry-after", ""}, {"server", ""}, {"set-cookie", ""}, {"strict-transport-security", ""},
+    {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""}, {"via", ""}, {"www-authenticate", ""},
+};
+
+constexpr size_t HPACK_STATIC_COUNT = 61;
+
+// Code lengths of the HPACK Huffman code (RFC 7541, Appendix B) for the 256
+// octets and EOS. The code is canonical, so the codes follow from these.
+constexpr uint8_t HPACK_HUFFMAN_LENGTHS[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+namespace hpack_huffman {
+
+constexpr int MAX_LENGTH = 30;
+constexpr int EOS = 256;
+
+struct Table {
+    uint32_t codes[257] = {};
+    uint32_t first[MAX_LENGTH + 1] = {};   // first code of each length
+    uint16_t count[MAX_LENGTH + 1] = {};   // codes of each length
+    uint16_t offset[MAX_LENGTH + 1] = {};  // where each length starts in `symbols`
+    uint16_t symbols[257] = {};            // ordered by code
+};
+
+constexpr Table build() {
+    Table table;
+    for (uint8_t length : HPACK_HUFFMAN_LENGTHS) table.count[length]++;
+
+    uint32_t code = 0;
+    uint16_t offset = 0;
+    for (int length = 1; length <= MAX_LENGTH; ++length) {
+        code = (code + table.count[length - 1]) << 1;
+        table.first[length] = code;
+        table.offset[length] = offset;
+        offset += table.count[length];
+    }
+
+    uint16_t next[MAX_LENGTH + 1] = {};
+    for (int symbol = 0; symbol <= EOS; ++symbol) {
+        int length = HPACK_HUFFMAN_LENGTHS[symbol];
+        table.codes[symbol] = table.first[length] + next[length];
+        table.symbols[table.offset[length] + next[length]] = (uint16_t)symbol;
+        next[length]++;
+    }
+    return table;
+}
+
+constexpr Table TABLE = build();
+
+static_assert(TABLE.codes['0'] == 0x0 && TABLE.codes['a'] == 0x3, "HPACK Huffman codes");
+static_assert(TABLE.codes[EOS] == 0x3fffffff, "HPACK Huffman codes");
+
+inline size_t encodedSize(std::string_view text) {
+    size_t bits = 0;
+    for (char c : text) bits += HPACK_HUFFMAN_LENGTHS[(uint8_t)c];
+    return (bits + 7) / 8;
+}
+
+inline void encode(std::string_view text, std::string& out) {
+    uint64_t bits = 0;
+    int pending = 0;
+    for (char c : text) {
+        int length = HPACK_HUFFMAN_LENGTHS[(uint8_t)c];
+        bits = (bits << length) | TABLE.codes[(uint8_t)c];
+        pending += length;
+        while (pending >= 8) {
+            pending -= 8;
+            out += (char)(bits >> pending);
+        }
+        bits &= (1ull << pending) - 1;
+    }
+    if (pending > 0) {
+        // Padded with the most significant bits of EOS, which are all ones.
+        out += (char)((bits << (8 - pending)) | ((1u << (8 - pending)) - 1));
+    }
+}
+
+inline bool decode(std::string_view data, std::string& out) {
+    uint32_t code = 0;
+    int length = 0;
+    for (char c : data) {
+        for (int bit = 7; bit >= 0; --bit) {
+            code = (code << 1) | (((uint8_t)c >> bit) & 1);
+            length++;
+            uint32_t index = code - TABLE.first[length];
+            if (index < TABLE.count[length]) {
+                uint16_t symbol = TABLE.symbols[TABLE.offset[length] + index];
+                if (symbol == EOS) return false;
+                out += (char)symbol;
+                code = 0;
+                length = 0;
+            } else if (length == MAX_LENGTH) {
+                return false;
+            }
+        }
+    }
+    return length < 8 && code == (1u << length) - 1;
+}
+
+} // namespace hpack_huffman
+
+inline void hpack_put_int(std::string& out, uint8_t flags, int prefix_bits, uint64_t value) {
+    uint64_t max = (1u << prefix_bits) - 1;
+    if (value < max) {
+        out += (char)(flags | value);
+        return;
+    }
+    out += (char)(flags | max);
+    value -= max;
+    while (value >= 128) {
+        out += (char)(value % 128 + 128);
+        value /= 128;
+    }
+    out += (char)value;
+}
+
+inline bool hpack_get_int(std::string_view& in, int prefix_bits, uint64_t& value) {
+    if (in.empty()) return false;
+    uint64_t max = (1u << prefix_bits) - 1;
+    value = (uint8_t)in[0] & max;
+    in.remove_prefix(1);
+    if (value < max) return true;
+
+    for (int shift = 0; shift < 32; shift += 7) {
+        if (in.empty()) return false;
+        uint8_t byte = (uint8_t)in[0];
+        in.remove_prefix(1);
+        value += (uint64_t)(byte & 127) << shift;
+        if (!(byte & 128)) return true;
+    }
+    return false;
+}
+
+// The static table followed by the dynamic one, newest entry first.
+class HpackTable {
+public:
+    static constexpr size_t DEFAULT_SIZE = 4096;
+    static constexpr size_t ENTRY_OVERHEAD = 32;
+
+    size_t maxSize() const { return max_size; }
+
+    void setMaxSize(size_t size) {
+        max_size = size;
+        evict(0);
+    }
+
+    void add(std::string_view name, std::string_view value) {
+        size_t size = name.size() + value.size() + ENTRY_OVERHEAD;
+        if (size > max_size) {
+            entries.clear();
+            used = 0;
+            return;
+        }
+        evict(size);
+        entries.push_front({std::string(name), std::string(value)});
+        used += size;
+    }
+
+    bool get(uint64_t index, std::string_view& name, std::string_view& value) const {
+        if (index == 0) return false;
+        if (index <= HPACK_STATIC_COUNT) {
+            name = HPACK_STATIC_TABLE[index][0];
+            value = HPACK_STATIC_TABLE[index][1];
+            return true;
+        }
+        index -= HPACK_STATIC_COUNT + 1;
+        if (index >= entries.size()) return false;
+        name = entries[index].name;
+        value = entries[index].value;
+        return true;
+    }
+
+    // The index of a matching entry, preferring one whose value matches too
+    // (`exact`), or 0 if the name isn't in the table.
+    size_t find(std::string_view name, std::string_view value, bool& exact) const {
+        size_t by_name = 0;
+        exact = false;
+        for (size_t i = 1; i <= HPACK_STATIC_COUNT; ++i) {
+            if (HPACK_STATIC_TABLE[i][0] != name) continue;
+            if (HPACK_STATIC_TABLE[i][1] == value) {
+                exact = true;
+                return i;
+            }
+            if (!by_name) by_name = i;
+        }
+        for (size_t i = 0; i < entries.size(); ++i) {
+            if (entries[i].name != name) continue;
+            if (entries[i].value == value) {
+                exact = true;
+                return HPACK_STATIC_COUNT + 1 + i;
+            }
+            if (!by_name) by_name = HPACK_STATIC_COUNT + 1 + i;
+        }
+        return by_name;
+    }
+
+private:
+    std::deque<HpackField> entries;
+    size_t used = 0;
+    size_t max_size = DEFAULT_SIZE;
+
+    void evict(size_t room) {
+        while (!entries.empty() && used + room > max_size) {
+            used -= entries.back().name.size() + entries.back().value.size() + ENTRY_OVERHEAD;
+            entries.pop_back();
+        }
+    }
+};
+
+class HpackDecoder {
+public:
+    // Decodes a whole header block; false on malformed input, which leaves
+    // the table out of step with the peer's and must end the connection.
+    bool decode(std::string_view in, std::vector<HpackField>& fields) {
+        bool at_start = true;
+        while (!in.empty()) {
+            uint8_t first = (uint8_t)in[0];
+            uint64_t index;
+
+            if (first & 0x80) {
+                std::string_view name, value;
+                if (!hpack_get_int(in, 7, index) || !table.get(index, name, value)) return false;
+                fields.push_back({std::string(name), std::string(value)});
+            } else if ((first & 0xe0) == 0x20) {
+                // Size updates may only open a block.
+                if (!at_start || !hpack_get_int(in, 5, index) || index > HpackTable::DEFAULT_SIZE) return false;
+                table.setMaxSize(index);
+                continue;
+            } else {
+                bool indexing = first & 0x40;
+                HpackField field;
+                if (!hpack_get_int(in, indexing ? 6 : 4, index)) return false;
+                if (index > 0) {
+                    std::string_view name, value;
+                    if (!table.get(index, name, value)) return false;
+                    field.name = name;
+                } else if (!readString(in, field.name)) {
+                    return false;
+                }
+                if (!readString(in, field.value)) return false;
+                if (indexing) table.add(field.name, field.value);
+                fields.push_back(std::move(field));
+            }
+            at_start = false;
+        }
+        return true;
+    }
+
+private:
+    HpackTable table;
+
+    static bool readString(std::string_view& in, std::string& out) {
+        if (in.empty()) return false;
+        bool huffman = (uint8_t)in[0] & 0x80;
+        uint64_t length;
+        if (!hpack_get_int(in, 7, length) || length > in.size()) return false;
+        std::string_view data = in.substr(0, length);
+        in.remove_prefix(length);
+        if (huffman) return hpack_huffman::decode(data, out);
+        out.assign(data);
+        return true;
+    }
+};
+
+class HpackEncoder {
+public:
+    // The peer's SETTINGS_HEADER_TABLE_SIZE. The table never grows past the
+    // default, so larger settings change nothing.
+    void setMaxSize(size_t size) {
+        size = std::min(size, HpackTable::DEFAULT_SIZE);
+        if (size != table.maxSize()) {
+            table.setMaxSize(size);
+            size_update = true;
+        }
+    }
+
+    void encode(const std::vector<std::pair<std::string, std::string>>& fields, std::string& out) {
+        if (size_update) {
+            hpack_put_int(out, 0x20, 5, table.maxSize());
+            size_update = false;
+        }
+        for (const auto& [name, value] : fields) {
+            encodeField(name, value, out);
+        }
+    }
+
+private:
+    HpackTable table;
+    bool size_update = false;
+
+    void encodeField(std::string_view name, std::string_view value, std::string& out) {
+        bool exact;
+        size_t index = table.find(name, value, exact);
+        if (exact) {
+            hpack_put_int(out, 0x80, 7, index);
+            return;
+        }
+
+        // Values that change on every response would only churn the table,
+        // and secrets must never be indexed by intermediaries either.
+        if (name == "set-cookie" || name == "authorization") {
+            hpack_put_int(out, 0x10, 4, index);
+        } else if (name == "content-length" || name == "date" || name == "etag" || name == "last-modified"
+                   || name == "location" || name == ":status") {
+            hpack_put_int(out, 0x00, 4, index);
+        } else {
+            hpack_put_int(out, 0x40, 6, index);
+            table.add(name, value);
+        }
+        if (index == 0) putString(name, out);
+        putString(value, out);
+    }
+
+    static void putString(std::string_view text, std::string& out) {
+        size_t huffman_size = hpack_huffman::encodedSize(text);
+        if (huffman_size < text.size()) {
+            hpack_put_int(out, 0x80, 7, huffman_size);
+            hpack_huffman::encode(text, out);
+        } else {
+            hpack_put_int(out, 0x00, 7, text.size());
+            out.append(text);
+        }
+    }
+};
+
+struct Http2Request {
+    std::vector<HpackField> fields;
+    std::string body;
+    int error = 0; // a status to answer with instead of running the handler
+};
+
+// Framing, flow control and HPACK state for one HTTP/2 connection. The
+// server feeds it the bytes it reads and gets back complete requests; it
+// hands in responses and takes out frames to write. Everything runs on the
+// connection's event loop thread.
+class Http2Session {
+public:
+    static constexpr uint32_t MAX_CONCURRENT_STREAMS = 100;
+    static constexpr uint32_t FRAME_SIZE = 16384;
+    static constexpr int64_t DEFAULT_WINDOW = 65535;
+    static constexpr int64_t MAX_WINDOW = 0x7fffffff;
+    // Request bodies are buffered whole before their handler runs. Only the
+    // oldest stream still sending one is given RECEIVE_WINDOW; the others
+    // keep STREAM_WINDOW until the bodies ahead of them are handed over, so
+    // a connection holds at most about max_body plus STREAM_WINDOW per
+    // stream, and one upload always makes progress.
+    static constexpr int64_t RECEIVE_WINDOW = 1 << 20;
+    static constexpr int64_t STREAM_WINDOW = DEFAULT_WINDOW;
+    static constexpr size_t MAX_HEADER_LIST_SIZE = 65536;
+    static constexpr size_t MAX_HEADER_BLOCK = 2 * MAX_HEADER_LIST_SIZE;
+
+    Http2Session(size_t max_body, size_t max_fields) : max_body(max_body), max_fields(max_fields) {}
+
+    // Queues the server's SETTINGS, which must be the first frame it sends.
+    void start() {
+        std::string settings;
+        putSetting(settings, H2Setting::MaxConcurrentStreams, MAX_CONCURRENT_STREAMS);
+        putSetting(settings, H2Setting::InitialWindowSize, STREAM_WINDOW);
+        putSetting(settings, H2Setting::MaxHeaderListSize, MAX_HEADER_LIST_SIZE);
+        putSetting(settings, H2Setting::EnablePush, 0);
+        appendFrame(control, H2Frame::Settings, 0, 0, settings);
+        queueWindowUpdate(0, RECEIVE_WINDOW - DEFAULT_WINDOW);
+    }
+
+    // Takes over from an HTTP/1.1 request carrying "Upgrade: h2c". That
+    // request becomes stream 1, already fully received. False if the
+    // HTTP2-Settings header doesn't decode.
+    bool upgrade(std::string_view http2_settings) {
+        std::string settings;
+        if (!decodeBase64Url(http2_settings, settings) || settings.size() % 6 != 0) return false;
+        if (applySettings(settings) != H2Error::NoError) return false;
+
+        Stream& stream = streams[1];
+        stream.send_window = peer_window;
+        stream.remote_closed = true;
+        stream.dispatched = true;
+        last_stream = 1;
+        return true;
+    }
+
+    // Consumes complete frames from `input` and returns how many bytes it
+    // used. Calls `on_request(stream_id, Http2Request)` for each request.
+    template <typename OnRequest>
+    size_t receive(std::string_view input, OnRequest on_request) {
+        size_t used = 0;
+        if (!preface_received) {
+            size_t n = std::min(input.size(), H2_PREFACE.size());
+            if (input.substr(0, n) != H2_PREFACE.substr(0, n)) {
+                fail(H2Error::Protocol);
+                return input.size();
+            }
+            if (n < H2_PREFACE.size()) return 0;
+            preface_received = true;
+            used = n;
+        }
+
+        while (!failed && input.size() - used >= 9) {
+            const uint8_t* header = (const uint8_t*)input.data() + used;
+            uint32_t length = header[0] << 16 | header[1] << 8 | header[2];
+            H2Frame type = (H2Frame)header[3];
+            uint8_t flags = header[4];
+            uint32_t stream = readUint32(header + 5) & 0x7fffffff;
+
+            if (length > FRAME_SIZE) {
+                fail(H2Error::FrameSize);
+                break;
+            }
+            if (input.size() - used - 9 < length) break;
+
+            std::string_view payload = input.substr(used + 9, length);
+            used += 9 + length;
+            if (!settings_received && type != H2Frame::Settings) {
+                fail(H2Error::Protocol);
+                break;
+            }
+            handleFrame(type, flags, stream, payload, on_request);
+        }
+        if (!failed) openReceiveWindow();
+        return failed ? input.size() : used;
+    }
+
+    // Queues the response head. With `end_stream` the response has no body;
+    // otherwise it follows through sendData().
+    void respond(uint32_t id, const std::vector<std::pair<std::string, std::string>>& fields, bool end_stream) {
+        auto it = streams.find(id);
+        if (it == streams.end() || it->second.headers_sent) return;
+
+        std::string block;
+        encoder.encode(fields, block);
+
+        std::string_view rest = block;
+        H2Frame type = H2Frame::Headers;
+        do {
+            std::string_view piece = rest.substr(0, peer_frame_size);
+            rest.remove_prefix(piece.size());
+            uint8_t flags = rest.empty() ? H2_END_HEADERS : 0;
+            if (type == H2Frame::Headers && end_stream) flags |= H2_END_STREAM;
+            appendFrame(control, type, flags, id, piece);
+            type = H2Frame::Continuation;
+        } while (!rest.empty());
+
+        it->second.headers_sent = true;
+        if (end_stream) {
+            it->second.local_closed = true;
+            closeStream(it);
+        }
+    }
+
+    void sendData(uint32_t id, std::string_view data, bool last) {
+        auto it = streams.find(id);
+        if (it == streams.end() || it->second.local_closed) return;
+        Stream& stream = it->second;
+        stream.out.erase(0, stream.out_offset);
+        stream.out_offset = 0;
+        stream.out.append(data);
+        stream.out_end = last;
+    }
+
+    void cancel(uint32_t id, H2Error error) {
+        if (streams.erase(id)) queueRstStream(id, error);
+    }
+
+    // Response bytes queued on the stream but not yet framed.
+    size_t buffered(uint32_t id) const {
+        auto it = streams.find(id);
+        return it == streams.end() ? 0 : it->second.out.size() - it->second.out_offset;
+    }
+
+    // Whether the stream still wants response data.
+    bool isOpen(uint32_t id) const {
+        auto it = streams.find(id);
+        return it != streams.end() && !it->second.local_closed;
+    }
+
+    // Moves pending frames into `out`, giving each stream with data one frame
+    // per round until about `budget` bytes are out or flow control stops it.
+    void takeOutput(std::string& out, size_t budget) {
+        out += control;
+        control.clear();
+
+        bool progress = true;
+        while (progress && out.size() < budget) {
+            progress = false;
+            for (auto it = streams.begin(); it != streams.end() && out.size() < budget;) {
+                Stream& stream = it->second;
+                size_t pending = stream.out.size() - stream.out_offset;
+                if (!stream.headers_sent || stream.local_closed || (pending == 0 && !stream.out_end)) {
+                    ++it;
+                    continue;
+                }
+
+                int64_t window = std::max<int64_t>(0, std::min(send_window, stream.send_window));
+                size_t n = std::min({pending, (size_t)peer_frame_size, (size_t)window});
+                if (n == 0 && pending > 0) {
+                    ++it;
+                    continue;
+                }
+
+                bool end = stream.out_end && n == pending;
+                appendFrame(out, H2Frame::Data, end ? H2_END_STREAM : 0, it->first,
+                            std::string_view(stream.out).substr(stream.out_offset, n));
+                stream.out_offset += n;
+                stream.send_window -= n;
+                send_window -= n;
+                progress = true;
+
+                if (end) {
+                    stream.local_closed = true;
+                    it = closeStream(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+
+        out += control;
+        control.clear();
+    }
+
+    size_t activeStreams() const { return streams.size(); }
+
+    // After a connection error, or once the peer has said goodbye and its
+    // last stream is done. Whatever takeOutput() returns is still sent.
+    bool finished() const {
+        return failed || (peer_going_away && streams.empty());
+    }
+
+private:
+    struct Stream {
+        Http2Request request;
+        int64_t send_window = 0;
+        int64_t receive_window = STREAM_WINDOW;
+        bool remote_closed = false;
+        bool dispatched = false;
+        bool headers_sent = false;
+        bool local_closed = false;
+        std::string out;
+        size_t out_offset = 0;
+        bool out_end = false;
+    };
+
+    size_t max_body;
+    size_t max_fields;
+    HpackDecoder decoder;
+    HpackEncoder encoder;
+    std::map<uint32_t, Stream> streams;
+    std::string control;
+    uint32_t last_stream = 0;
+    int64_t send_window = DEFAULT_WINDOW;
+    int64_t peer_window = DEFAULT_WINDOW;
+    uint32_t peer_frame_size = FRAME_SIZE;
+    bool preface_received = false;
+    bool settings_received = false;
+    bool peer_going_away = false;
+    bool failed = false;
+
+    // A HEADERS frame waiting for its CONTINUATIONs.
+    uint32_t continuing = 0;
+    std::string header_block;
+    bool header_end_stream = false;
+
+    static uint32_t readUint32(const uint8_t* p) {
+        return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+    }
+
+    static void putUint32(std::string& out, uint32_t value) {
+        out += (char)(value >> 24);
+        out += (char)(value >> 16);
+        out += (char)(value >> 8);
+        out += (char)value;
+    }
+
+    static void putSetting(std::string& out, H2Setting id, uint32_t value) {
+        out += (char)((uint16_t)id >> 8);
+        out += (char)id;
+        putUint32(out, value);
+    }
+
+    static void appendFrame(std::string& out, H2Frame type, uint8_t flags, uint32_t stream, std::string_view payload) {
+        out += (char)(payload.size() >> 16);
+        out += (char)(payload.size() >> 8);
+        out += (char)payload.size();
+        out += (char)type;
+        out += (char)flags;
+        putUint32(out, stream & 0x7fffffff);
+        out.append(payload);
+    }
+
+    static bool decodeBase64Url(std::string_view in, std::string& out) {
+        uint32_t bits = 0;
+        int count = 0;
+        for (char c : in) {
+            int value;
+            if (c >= 'A' && c <= 'Z') value = c - 'A';
+            else if (c >= 'a' && c <= 'z') value = c - 'a' + 26;
+            else if (c >= '0' && c <= '9') value = c - '0' + 52;
+            else if (c == '-' || c == '+') value = 62;
+            else if (c == '_' || c == '/') value = 63;
+            else if (c == '=') break;
+            else return false;
+
+            bits = (bits << 6) | value;
+            count += 6;
+            if (count >= 8) {
+                count -= 8;
+                out += (char)(bits >> count);
+            }
+        }
+        return true;
+    }
+
+    void fail(H2Error error) {
+        if (failed) return;
+        failed = true;
+        streams.clear();
+        std::string payload;
+        putUint32(payload, last_stream);
+        putUint32(payload, (uint32_t)error);
+        appendFrame(control, H2Frame::GoAway, 0, 0, payload);
+    }
+
+    void queueRstStream(uint32_t id, H2Error error) {
+        std::string payload;
+        putUint32(payload, (uint32_t)error);
+        appendFrame(control, H2Frame::RstStream, 0, id, payload);
+    }
+
+    void queueWindowUpdate(uint32_t id, uint32_t increment) {
+        if (increment == 0) return;
+        std::string payload;
+        putUint32(payload, increment);
+        appendFrame(control, H2Frame::WindowUpdate, 0, id, payload);
+    }
+
+    // A stream is done once both sides have ended it. A response that ends
+    // before the request body does tells the client to stop sending.
+    std::map<uint32_t, Stream>::iterator closeStream(std::map<uint32_t, Stream>::iterator it) {
+        if (!it->second.local_closed) return std::next(it);
+        if (!it->second.remote_closed) queueRstStream(it->first, H2Error::NoError);
+        return streams.erase(it);
+    }
+
+    H2Error applySettings(std::string_view payload) {
+        for (size_t i = 0; i + 6 <= payload.size(); i += 6) {
+            const uint8_t* p = (const uint8_t*)payload.data() + i;
+            H2Setting id = (H2Setting)(p[0] << 8 | p[1]);
+            uint32_t value = readUint32(p + 2);
+
+            switch (id) {
+                case H2Setting::HeaderTableSize:
+                    encoder.setMaxSize(value);
+                    break;
+                case H2Setting::EnablePush:
+                    if (value > 1) return H2Error::Protocol;
+                    break;
+                case H2Setting::InitialWindowSize: {
+                    if (value > MAX_WINDOW) return H2Error::FlowControl;
+                    int64_t delta = (int64_t)value - peer_window;
+                    for (auto& [stream_id, stream] : streams) {
+                        stream.send_window += delta;
+                        if (stream.send_window > MAX_WINDOW) return H2Error::FlowControl;
+                    }
+                    peer_window = value;
+                    break;
+                }
+                case H2Setting::MaxFrameSize:
+                    if (value < FRAME_SIZE || value > 0xffffff) return H2Error::Protocol;
+                    peer_frame_size = value;
+                    break;
+                default:
+                    break;
+            }
+        }
+        return H2Error::NoError;
+    }
+
+    // Strips the padding of a PADDED frame; false if it is malformed.
+    static bool unpad(uint8_t flags, std::string_view& payload) {
+        if (!(flags & H2_PADDED)) return true;
+        if (payload.empty()) return false;
+        size_t padding = (uint8_t)payload[0];
+        payload.remove_prefix(1);
+        if (padding > payload.size()) return false;
+        payload.remove_suffix(padding);
+        return true;
+    }
+
+    template <typename OnRequest>
+    void handleFrame(H2Frame type, uint8_t flags, uint32_t id, std::string_view payload, OnRequest& on_request) {
+        if (continuing && (type != H2Frame::Continuation || id != continuing)) {
+            fail(H2Error::Protocol);
+            return;
+        }
+
+        switch (type) {
+            case H2Frame::Data:
+                onData(flags, id, payload, on_request);
+                break;
+
+            case H2Frame::Headers:
+                onHeaders(flags, id, payload, on_request);
+                break;
+
+            case H2Frame::Continuation:
+                if (!continuing) {
+                    fail(H2Error::Protocol);
+                    return;
+                }
+                header_block.append(payload);
+                if (header_block.size() > MAX_HEADER_BLOCK) {
+                    fail(H2Error::EnhanceYourCalm);
+                    return;
+                }
+                if (flags & H2_END_HEADERS) finishHeaders(on_request);
+                break;
+
+            case H2Frame::Priority:
+                if (id == 0) fail(H2Error::Protocol);
+                else if (payload.size() != 5) queueRstStream(id, H2Error::FrameSize);
+                break;
+
+            case H2Frame::RstStream:
+                if (id == 0 || id > last_stream) fail(H2Error::Protocol);
+                else if (payload.size() != 4) fail(H2Error::FrameSize);
+                else streams.erase(id);
+                break;
+
+            case H2Frame::Settings:
+                onSettings(flags, id, payload);
+                break;
+
+            case H2Frame::PushPromise:
+                fail(H2Error::Protocol);
+                break;
+
+            case H2Frame::Ping:
+                if (id != 0) fail(H2Error::Protocol);
+                else if (payload.size() != 8) fail(H2Error::FrameSize);
+                else if (!(flags & H2_ACK)) appendFrame(control, H2Frame::Ping, H2_ACK, 0, payload);
+                break;
+
+            case H2Frame::GoAway:
+                if (id != 0) fail(H2Error::Protocol);
+                else peer_going_away = true;
+                break;
+
+            case H2Frame::WindowUpdate:
+                onWindowUpdate(id, payload);
+                break;
+
+            default:
+                break; // unknown frame types are ignored
+        }
+    }
+
+    void onSettings(uint8_t flags, uint32_t id, std::string_view payload) {
+        if (id != 0) {
+            fail(H2Error::Protocol);
+            return;
+        }
+        if (flags & H2_ACK) {
+            if (!payload.empty()) fail(H2Error::FrameSize);
+            return;
+        }
+        if (payload.size() % 6 != 0) {
+            fail(H2Error::FrameSize);
+            return;
+        }
+
+        H2Error error = applySettings(payload);
+        if (error != H2Error::NoError) {
+            fail(error);
+            return;
+        }
+        settings_received = true;
+        appendFrame(control, H2Frame::Settings, H2_ACK, 0, "");
+    }
+
+    void onWindowUpdate(uint32_t id, std::string_view payload) {
+        if (payload.size() != 4) {
+            fail(H2Error::FrameSize);
+            return;
+        }
+        uint32_t increment = readUint32((const uint8_t*)payload.data()) & 0x7fffffff;
+
+        if (id == 0) {
+            send_window += increment;
+            if (increment == 0) fail(H2Error::Protocol);
+            else if (send_window > MAX_WINDOW) fail(H2Error::FlowControl);
+            return;
+        }
+
+        auto it = streams.find(id);
+        if (it == streams.end()) {
+            if (id > last_stream) fail(H2Error::Protocol);
+            return;
+        }
+        it->second.send_window += increment;
+        if (increment == 0) cancel(id, H2Error::Protocol);
+        else if (it->second.send_window > MAX_WINDOW) cancel(id, H2Error::FlowControl);
+    }
+
+    template <typename OnRequest>
+    void onData(uint8_t flags, uint32_t id, std::string_view payload, OnRequest& on_request) {
+        if (id == 0) {
+            fail(H2Error::Protocol);
+            return;
+        }
+
+        // Padding counts against flow control too. The connection window is
+        // handed straight back; stream windows bound what is buffered.
+        uint32_t flow = (uint32_t)payload.size();
+        if (!unpad(flags, payload)) {
+            fail(H2Error::Protocol);
+            return;
+        }
+        queueWindowUpdate(0, flow);
+
+        auto it = streams.find(id);
+        if (it == streams.end()) {
+            if (id > last_stream) fail(H2Error::Protocol);
+            return;
+        }
+        Stream& stream = it->second;
+        if (stream.remote_closed) {
+            cancel(id, H2Error::StreamClosed);
+            return;
+        }
+        if (flow > stream.receive_window) {
+            cancel(id, H2Error::FlowControl);
+            return;
+        }
+        stream.receive_window -= flow;
+
+        if (!stream.dispatched) {
+            if (stream.request.body.size() + payload.size() > max_body) {
+                stream.request.error = 413;
+                stream.request.body.clear();
+                dispatch(id, stream, on_request);
+            } else {
+                stream.request.body.append(payload);
+            }
+        }
+
+        if (flags & H2_END_STREAM) {
+            stream.remote_closed = true;
+            if (!stream.dispatched) dispatch(id, stream, on_request);
+            closeStream(it);
+        } else if (stream.dispatched) {
+            // The rest of a refused body is dropped as it comes.
+            queueWindowUpdate(id, flow);
+            stream.receive_window += flow;
+        }
+    }
+
+    // Tops up the window of the oldest stream still sending its body.
+    void openReceiveWindow() {
+        for (auto& [id, stream] : streams) {
+            if (stream.dispatched || stream.remote_closed) continue;
+            if (stream.receive_window < RECEIVE_WINDOW / 2) {
+                queueWindowUpdate(id, (uint32_t)(RECEIVE_WINDOW - stream.receive_window));
+                stream.receive_window = RECEIVE_WINDOW;
+            }
+            return;
+        }
+    }
+
+    template <typename OnRequest>
+    void onHeaders(uint8_t flags, uint32_t id, std::string_view payload, OnRequest& on_request) {
+        if (id == 0 || id % 2 == 0) {
+            fail(H2Error::Protocol);
+            return;
+        }
+        if (!unpad(flags, payload)) {
+            fail(H2Error::Protocol);
+            return;
+        }
+        if (flags & H2_PRIORITY) {
+            if (payload.size() < 5) {
+                fail(H2Error::FrameSize);
+                return;
+            }
+            payload.remove_prefix(5);
+        }
+
+        header_block.assign(payload);
+        header_end_stream = flags & H2_END_STREAM;
+        continuing = id;
+        if (flags & H2_END_HEADERS) finishHeaders(on_request);
+    }
+
+    template <typename OnRequest>
+    void finishHeaders(OnRequest& on_request) {
+        uint32_t id = continuing;
+        continuing = 0;
+
+        // Blocks must be decoded even for streams that are refused, or the
+        // dynamic table falls out of step with the client's.
+        std::vector<HpackField> fields;
+        bool decoded = decoder.decode(header_block, fields);
+        header_block.clear();
+        if (!decoded) {
+            fail(H2Error::Compression);
+            return;
+        }
+
+        auto it = streams.find(id);
+        if (it != streams.end()) {
+            // Trailers. Their fields are dropped.
+            Stream& stream = it->second;
+            if (stream.remote_closed) {
+                cancel(id, H2Error::StreamClosed);
+            } else if (!header_end_stream) {
+                cancel(id, H2Error::Protocol);
+            } else {
+                stream.remote_closed = true;
+                if (!stream.dispatched) dispatch(id, stream, on_request);
+                closeStream(it);
+            }
+            return;
+        }
+
+        if (id <= last_stream) return; // a stream that was reset or has finished
+        last_stream = id;
+        if (peer_going_away) return;
+        if (streams.size() >= MAX_CONCURRENT_STREAMS) {
+            queueRstStream(id, H2Error::RefusedStream);
+            return;
+        }
+
+        if (!validRequest(fields)) {
+            queueRstStream(id, H2Error::Protocol);
+            return;
+        }
+
+        Stream& stream = streams[id];
+        stream.send_window = peer_window;
+        stream.remote_closed = header_end_stream;
+
+        size_t list_size = 0;
+        for (const auto& field : fields) {
+            list_size += field.name.size() + field.value.size() + HpackTable::ENTRY_OVERHEAD;
+        }
+        if (fields.size() > max_fields || list_size > MAX_HEADER_LIST_SIZE) {
+            stream.request.error = 431;
+        } else {
+            stream.request.fields = std::move(fields);
+        }
+
+        if (stream.request.error || stream.remote_closed) {
+            dispatch(id, stream, on_request);
+        }
+    }
+
+    // RFC 9113, 8.2 and 8.3: non-empty lowercase names, pseudo-headers
+    // first, the request ones present, and no connection-specific fields.
+    static bool validRequest(const std::vector<HpackField>& fields) {
+        bool method = false, path = false, regular = false;
+        for (const auto& field : fields) {
+            if (field.name.empty()) return false;
+            for (char c : field.name) {
+                if (c >= 'A' && c <= 'Z') return false;
+            }
+            if (field.name[0] == ':') {
+                if (regular) return false;
+                if (field.name == ":method") method = true;
+                else if (field.name == ":path") path = !field.value.empty();
+                else if (field.name != ":scheme" && field.name != ":authority") return false;
+                continue;
+            }
+            regular = true;
+            if (field.name == "connection" || field.name == "keep-alive" || field.name == "proxy-connection"
+                || field.name == "transfer-encoding" || field.name == "upgrade") {
+                return false;
+            }
+            if (field.name == "te" && field.value != "trailers") return false;
+        }
+        return method && path;
+    }
+
+    template <typename OnRequest>
+    void dispatch(uint32_t id, Stream& stream, OnRequest& on_request) {
+        stream.dispatched = true;
+        on_request(id, std::move(stream.request));
+    }
+};
+
+#endif
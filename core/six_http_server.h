@@ -4,24 +4,60 @@
 #include <string>
 #include <functional>
 #include <map>
+#include <set>
 #include <iostream>
 #include <sstream>
 #include <cstring>
+#include <climits>
+#include <cstdint>
 #include <unistd.h>
+#include <cerrno>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <ctime>
 #include <fstream>
 #include <algorithm>
 #include <cctype>
 #include <thread>
-#include <queue>
+#include <chrono>
+#include <atomic>
+#include <type_traits>
+#include <new>
+#include <cstddef>
 #include <mutex>
 #include <condition_variable>
 #include <memory>
 #include <vector>
+#include <deque>
+#include <unordered_map>
+#include <string_view>
+#include <charconv>
+#include <stdexcept>
 #include <regex>
+#include <pthread.h>
+#include <csignal>
+#include <sched.h>
+#include "six_io_uring.h"
+#include "six_multipart.h"
+#include "six_compress.h"
+#include "six_arena.h"
+#include "six_headers.h"
+#include "six_access_log.h"
+#include "six_metrics.h"
+#include "six_timer_wheel.h"
+#include "six_http2.h"
+#include "six_tls.h"
+#include "six_response_cache.h"
 
 using namespace std;
 
@@ -29,12 +65,30 @@ const string PROTOCOL = "http";
 const string IP = "localhost";
 const int PORT = 8000;
 
-inline string url_decode(const string& str) {
+enum class IoBackend { Epoll, IoUring };
+
+#ifdef SIX_USE_IO_URING
+const IoBackend DEFAULT_IO_BACKEND = IoBackend::IoUring;
+#else
+const IoBackend DEFAULT_IO_BACKEND = IoBackend::Epoll;
+#endif
+
+inline int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+inline string url_decode(std::string_view str) {
     string result;
+    result.reserve(str.length());
     for (size_t i = 0; i < str.length(); ++i) {
         if (str[i] == '%' && i + 2 < str.length()) {
             int value = 0;
-            sscanf(str.substr(i + 1, 2).c_str(), "%x", &value);
+            for (size_t j = i + 1; j < i + 3 && hex_value(str[j]) >= 0; ++j) {
+                value = value * 16 + hex_value(str[j]);
+            }
             result += static_cast<char>(value);
             i += 2;
         } else if (str[i] == '+') {
@@ -49,6 +103,7 @@ inline string url_decode(const string& str) {
 class FormData {
 public:
     std::map<std::string, std::string> data;
+    std::multimap<std::string, UploadedFile> files;
     
     std::string get(const char* key) const {
         return get(std::string(key));
@@ -61,31 +116,138 @@ public:
         }
         return "";
     }
+
+    // The first file sent under `key`.
+    const UploadedFile* file(const std::string& key) const {
+        auto it = files.find(key);
+        if (it != files.end()) {
+            return &it->second;
+        }
+        return nullptr;
+    }
+
+    // Every file sent under `key`, as from <input type="file" multiple>.
+    std::vector<const UploadedFile*> all_files(const std::string& key) const {
+        std::vector<const UploadedFile*> result;
+        auto [begin, end] = files.equal_range(key);
+        for (auto it = begin; it != end; ++it) {
+            result.push_back(&it->second);
+        }
+        return result;
+    }
 };
 
+// The method, path, headers and body are views into `storage`, a single
+// copy of the request bytes taken off the connection buffer. Copies of the
+// request share it.
 struct http_request {
-    std::string method;
-    std::string path;
-    std::map<std::string, std::string> headers;
-    std::string body;
-    std::string raw;
+    StrView method;
+    StrView path;
+    StrView query;
+    StrView version;
+    HeaderMap headers;
+    StrView body;
+    StrView raw;
     std::string remote_addr;
     FormData forms;
     std::map<std::string, std::string> params;
+    std::shared_ptr<const char[]> storage;
+};
+
+struct FileBody {
+    int fd;
+    size_t size;
+    std::string path;
+    time_t mtime;
+
+    FileBody(int fd, size_t size, std::string path = "", time_t mtime = 0)
+        : fd(fd), size(size), path(std::move(path)), mtime(mtime) {}
+    FileBody(const FileBody&) = delete;
+    FileBody& operator=(const FileBody&) = delete;
+    ~FileBody() { if (fd >= 0) close(fd); }
+};
+
+// A response body produced piece by piece. `next` fills `chunk` and returns
+// false once it has produced the last piece. It runs on a worker thread and
+// is only called again after the previous piece has reached the socket.
+struct StreamBody {
+    std::function<bool(std::string& chunk)> next;
+
+    StreamBody(std::function<bool(std::string&)> next) : next(std::move(next)) {}
 };
 
 struct http_response {
     int status = 200;
     std::string contentType = "text/html";
     std::string body;
+    std::shared_ptr<const std::string> shared_body; // sent in place of `body`, without a copy
+    std::shared_ptr<FileBody> file;
+    std::shared_ptr<StreamBody> stream;
     std::string location = "";
     std::map<std::string, std::string> headers;
 
     http_response(const std::string& content = "") : body(content) {}
 };
 
-http_response* g_current_response = nullptr;
-http_request* g_current_request = nullptr;
+inline const char* status_reason(int status) {
+    switch (status) {
+        case 100: return "Continue";
+        case 101: return "Switching Protocols";
+        case 200: return "OK";
+        case 201: return "Created";
+        case 202: return "Accepted";
+        case 204: return "No Content";
+        case 206: return "Partial Content";
+        case 301: return "Moved Permanently";
+        case 302: return "Found";
+        case 303: return "See Other";
+        case 304: return "Not Modified";
+        case 307: return "Temporary Redirect";
+        case 308: return "Permanent Redirect";
+        case 400: return "Bad Request";
+        case 401: return "Unauthorized";
+        case 403: return "Forbidden";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 408: return "Request Timeout";
+        case 409: return "Conflict";
+        case 410: return "Gone";
+        case 411: return "Length Required";
+        case 413: return "Payload Too Large";
+        case 414: return "URI Too Long";
+        case 415: return "Unsupported Media Type";
+        case 422: return "Unprocessable Entity";
+        case 429: return "Too Many Requests";
+        case 431: return "Request Header Fields Too Large";
+        case 500: return "Internal Server Error";
+        case 501: return "Not Implemented";
+        case 502: return "Bad Gateway";
+        case 503: return "Service Unavailable";
+        case 504: return "Gateway Timeout";
+        case 505: return "HTTP Version Not Supported";
+        default: return "Unknown";
+    }
+}
+
+inline const string& http_date() {
+    thread_local time_t cached_at = 0;
+    thread_local string cached;
+    time_t now = time(0);
+    if (now != cached_at) {
+        tm gmt;
+        gmtime_r(&now, &gmt);
+        char buffer[64];
+        strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", &gmt);
+        cached = buffer;
+        cached_at = now;
+    }
+    return cached;
+}
+
+// The request a worker is handling, for helpers such as login_user().
+// Async handlers set them again each time they resume.
+thread_local http_response* g_current_response = nullptr;
+thread_local http_request* g_current_request = nullptr;
 
 struct RoutePattern {
     std::string pattern;
@@ -107,9 +269,11 @@ struct RoutePattern {
         regex = std::regex("^" + regex_pattern + "$");
     }
 
-    bool matches(const std::string& path, std::map<std::string, std::string>& params) const {
-        std::smatch match;
-        if (std::regex_match(path, match, regex)) {
+    bool matches(std::string_view path, std::map<std::string, std::string>& params) const {
+        using iterator = std::string_view::const_iterator;
+        using sub_match = std::sub_match<iterator>;
+        std::match_results<iterator, std::pmr::polymorphic_allocator<sub_match>> match(&request_arena());
+        if (std::regex_match(path.begin(), path.end(), match, regex)) {
             params.clear();
             for (size_t i = 0; i < param_names.size(); ++i) {
                 params[param_names[i]] = match[i + 1].str();
@@ -120,48 +284,206 @@ struct RoutePattern {
     }
 };
 
+inline void pin_current_thread(int cpu) {
+    if (cpu < 0) return;
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+        cerr << "[WARN] Failed to pin thread to CPU " << cpu << endl;
+    }
+}
+
+class Task {
+public:
+    // Room for the closures that dispatch a request, which carry an
+    // http_request by value along with a few words of connection state.
+    static constexpr size_t INLINE_SIZE = sizeof(http_request) + 64;
+
+    // Whether a callable of type Fn is stored in place rather than on the heap.
+    template <typename Fn>
+    static constexpr bool fits_inline = sizeof(Fn) <= INLINE_SIZE
+        && alignof(Fn) <= alignof(std::max_align_t)
+        && std::is_nothrow_move_constructible_v<Fn>;
+
+    Task() = default;
+
+    template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, Task>>>
+    Task(F&& f) {
+        using Fn = std::decay_t<F>;
+        if constexpr (fits_inline<Fn>) {
+            new (storage) Fn(std::forward<F>(f));
+            ops = inlineOps<Fn>();
+        } else {
+            *reinterpret_cast<Fn**>(storage) = new Fn(std::forward<F>(f));
+            ops = heapOps<Fn>();
+        }
+    }
+
+    Task(Task&& other) noexcept {
+        moveFrom(other);
+    }
+
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            reset();
+            moveFrom(other);
+        }
+        return *this;
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    ~Task() { reset(); }
+
+    explicit operator bool() const { return ops != nullptr; }
+
+    void operator()() { ops->invoke(storage); }
+
+private:
+    struct Ops {
+        void (*invoke)(void*);
+        void (*move)(void* dst, void* src);
+        void (*destroy)(void*);
+    };
+
+    alignas(std::max_align_t) unsigned char storage[INLINE_SIZE];
+    const Ops* ops = nullptr;
+
+    template <typename Fn>
+    static const Ops* inlineOps() {
+        static const Ops table = {
+            [](void* p) { (*static_cast<Fn*>(p))(); },
+            [](void* dst, void* src) {
+                new (dst) Fn(std::move(*static_cast<Fn*>(src)));
+                static_cast<Fn*>(src)->~Fn();
+            },
+            [](void* p) { static_cast<Fn*>(p)->~Fn(); }
+        };
+        return &table;
+    }
+
+    template <typename Fn>
+    static const Ops* heapOps() {
+        static const Ops table = {
+            [](void* p) { (**static_cast<Fn**>(p))(); },
+            [](void* dst, void* src) { *static_cast<Fn**>(dst) = *static_cast<Fn**>(src); },
+            [](void* p) { delete *static_cast<Fn**>(p); }
+        };
+        return &table;
+    }
+
+    void moveFrom(Task& other) {
+        ops = other.ops;
+        if (ops) {
+            ops->move(storage, other.storage);
+            other.ops = nullptr;
+        }
+    }
+
+    void reset() {
+        if (ops) {
+            ops->destroy(storage);
+            ops = nullptr;
+        }
+    }
+};
+
 class ThreadPool {
 private:
+    struct alignas(64) WorkerQueue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
     std::vector<std::thread> workers;
-    std::queue<std::function<void()>> tasks;
-    std::mutex queue_mutex;
+    std::vector<std::unique_ptr<WorkerQueue>> queues;
+    std::atomic<size_t> pending{0};
+    std::atomic<size_t> idle{0};
+    std::atomic<size_t> next_queue{0};
+    std::atomic<bool> stop{false};
+    std::mutex sleep_mutex;
     std::condition_variable cv;
-    bool stop = false;
+
+    static ThreadPool*& currentPool() {
+        thread_local ThreadPool* pool = nullptr;
+        return pool;
+    }
+
+    static size_t& currentIndex() {
+        thread_local size_t index = 0;
+        return index;
+    }
+
+    bool popLocal(size_t index, Task& task) {
+        WorkerQueue& queue = *queues[index];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) return false;
+        task = std::move(queue.tasks.front());
+        queue.tasks.pop_front();
+        return true;
+    }
+
+    bool steal(size_t thief, Task& task) {
+        for (size_t i = 1; i < queues.size(); ++i) {
+            WorkerQueue& victim = *queues[(thief + i) % queues.size()];
+            std::unique_lock<std::mutex> lock(victim.mutex, std::try_to_lock);
+            if (!lock.owns_lock() || victim.tasks.empty()) continue;
+            task = std::move(victim.tasks.back());
+            victim.tasks.pop_back();
+            return true;
+        }
+        return false;
+    }
+
+    void workerLoop(size_t index, int cpu) {
+        pin_current_thread(cpu);
+        currentPool() = this;
+        currentIndex() = index;
+
+        while (true) {
+            Task task;
+            if (popLocal(index, task) || steal(index, task)) {
+                pending.fetch_sub(1);
+                try {
+                    task();
+                } catch(const std::exception& e) {
+                    cerr << "[ERROR] Task exception: " << e.what() << endl;
+                } catch(...) {
+                    cerr << "[ERROR] Unknown task exception" << endl;
+                }
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            idle.fetch_add(1);
+            cv.wait(lock, [this] { return pending.load() > 0 || stop.load(); });
+            idle.fetch_sub(1);
+
+            if (stop.load() && pending.load() == 0) return;
+        }
+    }
     
 public:
-    ThreadPool(size_t num_threads = 4) {
+    static ThreadPool* current() {
+        return currentPool();
+    }
+
+    ThreadPool(size_t num_threads = 4, int cpu = -1) {
         if (num_threads < 2) num_threads = 2;
-        if (num_threads > 16) num_threads = 16;
-        
+
         for(size_t i = 0; i < num_threads; ++i) {
-            workers.emplace_back([this] {
-                while(true) {
-                    std::unique_lock<std::mutex> lock(queue_mutex);
-                    cv.wait(lock, [this] { return !tasks.empty() || stop; });
-                    
-                    if(stop && tasks.empty()) return;
-                    
-                    if(tasks.empty()) continue;
-                    
-                    auto task = tasks.front();
-                    tasks.pop();
-                    lock.unlock();
-                    
-                    try {
-                        task();
-                    } catch(const std::exception& e) {
-                        cerr << "[ERROR] Task exception: " << e.what() << endl;
-                    } catch(...) {
-                        cerr << "[ERROR] Unknown task exception" << endl;
-                    }
-                }
-            });
+            queues.push_back(std::make_unique<WorkerQueue>());
+        }
+        for(size_t i = 0; i < num_threads; ++i) {
+            workers.emplace_back([this, i, cpu] { workerLoop(i, cpu); });
         }
     }
     
     ~ThreadPool() {
         {
-            std::unique_lock<std::mutex> lock(queue_mutex);
+            std::unique_lock<std::mutex> lock(sleep_mutex);
             stop = true;
         }
         cv.notify_all();
@@ -172,109 +494,592 @@ public:
         }
     }
     
-    void enqueue(std::function<void()> task) {
+    void enqueue(Task task) {
+        if(stop.load()) {
+            throw std::runtime_error("Cannot enqueue task on stopped thread pool");
+        }
+
+        size_t index = currentPool() == this
+            ? currentIndex()
+            : next_queue.fetch_add(1, std::memory_order_relaxed) % queues.size();
         {
-            std::unique_lock<std::mutex> lock(queue_mutex);
-            if(stop) {
-                throw std::runtime_error("Cannot enqueue task on stopped thread pool");
-            }
-            tasks.push(task);
+            WorkerQueue& queue = *queues[index];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back(std::move(task));
+        }
+
+        pending.fetch_add(1);
+        if (idle.load() > 0) {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            cv.notify_one();
         }
-        cv.notify_one();
     }
     
     size_t pending_tasks() {
-        std::unique_lock<std::mutex> lock(queue_mutex);
-        return tasks.size();
+        return pending.load();
+    }
+
+    size_t size() const {
+        return workers.size();
+    }
+};
+
+class BufferPool {
+public:
+    static constexpr size_t BLOCK_SIZE = 16384;
+    static constexpr size_t MAX_FREE_BLOCKS = 1024;
+
+    std::unique_ptr<char[]> acquire() {
+        if (free_blocks.empty()) {
+            return std::unique_ptr<char[]>(new char[BLOCK_SIZE]);
+        }
+        auto block = std::move(free_blocks.back());
+        free_blocks.pop_back();
+        return block;
+    }
+
+    void release(std::unique_ptr<char[]> block) {
+        if (free_blocks.size() < MAX_FREE_BLOCKS) {
+            free_blocks.push_back(std::move(block));
+        }
+    }
+
+private:
+    std::vector<std::unique_ptr<char[]>> free_blocks;
+};
+
+class RequestBuffer {
+public:
+    RequestBuffer(BufferPool* pool = nullptr) : pool(pool) {}
+    RequestBuffer(const RequestBuffer&) = delete;
+    RequestBuffer& operator=(const RequestBuffer&) = delete;
+    ~RequestBuffer() { reset(); }
+
+    const char* data() const { return block.get() + start; }
+    size_t size() const { return end - start; }
+    bool empty() const { return start == end; }
+    std::string_view view() const { return std::string_view(data(), size()); }
+
+    size_t writable() const { return capacity - end; }
+    char* writePtr() { return block.get() + end; }
+    void commit(size_t n) { end += n; }
+
+    void reserve(size_t n) {
+        if (!block) {
+            if (pool && n <= BufferPool::BLOCK_SIZE) {
+                block = pool->acquire();
+                capacity = BufferPool::BLOCK_SIZE;
+            } else {
+                capacity = std::max(n, BufferPool::BLOCK_SIZE);
+                block.reset(new char[capacity]);
+            }
+            return;
+        }
+
+        if (capacity - start >= n) return;
+        if (capacity >= n) {
+            // Room enough once the unread bytes move to the front of the block.
+            memmove(block.get(), data(), size());
+            end -= start;
+            start = 0;
+            return;
+        }
+
+        size_t new_capacity = std::max(capacity * 2, n);
+        std::unique_ptr<char[]> grown(new char[new_capacity]);
+        memcpy(grown.get(), data(), size());
+        end -= start;
+        start = 0;
+        recycle();
+        block = std::move(grown);
+        capacity = new_capacity;
+    }
+
+    void consume(size_t n) {
+        start += n;
+        if (start >= end) {
+            reset();
+        }
+    }
+
+    void reset() {
+        recycle();
+        capacity = start = end = 0;
+    }
+
+private:
+    BufferPool* pool;
+    std::unique_ptr<char[]> block;
+    size_t capacity = 0;
+    size_t start = 0;
+    size_t end = 0;
+
+    void recycle() {
+        if (block && pool && capacity == BufferPool::BLOCK_SIZE) {
+            pool->release(std::move(block));
+        }
+        block.reset();
     }
 };
 
 class six {
 public:
     using route_handler = std::function<http_response(const http_request)>;
+    using response_callback = std::function<void(http_response)>;
+    using deferred_handler = std::function<void(http_request&, response_callback)>;
     
-    six(int port = PORT, int num_workers = 4) 
-        : port(port), pool(num_workers) {}
+    six(int port = PORT, int num_workers = 4, int num_shards = 1, IoBackend backend = DEFAULT_IO_BACKEND)
+        : port(port), backend(backend) {
+        if (num_shards < 1) num_shards = 1;
+        int cpus = (int)std::max(1u, std::thread::hardware_concurrency());
+        for (int i = 0; i < num_shards; ++i) {
+            int cpu = num_shards > 1 ? i % cpus : -1;
+            loops.push_back(std::make_unique<EventLoop>(num_workers, cpu));
+        }
+    }
 
     void get(const string& route, route_handler h) {
-        routesGET.emplace_back(RoutePattern(route), h);
+        addRoute(routesGET, route, h, nullptr);
+    }
+
+    // Serves repeat requests from memory for `policy.ttl` seconds without
+    // calling the handler. Only 200 responses are kept, and not those that
+    // set a cookie, stream, or send a file or "Cache-Control: private" or
+    // "no-store". Pages that depend on the logged-in user need vary_on_cookie.
+    void get(const string& route, route_handler h, cache_policy policy) {
+        addRoute(routesGET, route, h, nullptr);
+        routesGET.back().cache = std::make_shared<const cache_policy>(std::move(policy));
     }
 
     void post(const string& route, route_handler h) {
-        routesPOST.emplace_back(RoutePattern(route), h);
+        addRoute(routesPOST, route, h, nullptr);
+    }
+
+    template <typename Handler>
+    void get_async(const string& route, Handler h) {
+        addRoute(routesGET, route, nullptr, deferred(std::move(h)));
+    }
+
+    template <typename Handler>
+    void post_async(const string& route, Handler h) {
+        addRoute(routesPOST, route, nullptr, deferred(std::move(h)));
     }
 
     void setFallback(route_handler h) {
         fallback = h;
     }
 
-    void start() {
-        int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-        if (server_fd < 0) { perror("socket"); return; }
+    void setKeepAlive(int timeout_seconds, int max_requests = 100) {
+        keep_alive_timeout = timeout_seconds;
+        keep_alive_max_requests = max_requests;
+    }
 
-        int opt = 1;
-        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-            perror("setsockopt");
-            close(server_fd);
-            return;
+    // Time a client has from the first byte of a request (or from connecting)
+    // to the end of its head. 0 turns the limit off.
+    void setHeaderTimeout(int seconds) {
+        header_timeout = seconds;
+    }
+
+    // Requests whose handler hasn't answered in time get 504 and the
+    // connection is closed; the handler itself runs to completion. Off (0)
+    // by default.
+    void setHandlerTimeout(int seconds) {
+        handler_timeout = seconds;
+    }
+
+    // h2c: HTTP/2 over cleartext, by prior knowledge or "Upgrade: h2c". On
+    // by default.
+    void setHttp2(bool enabled) {
+        http2 = enabled;
+    }
+
+    // Accepts connections on a Unix domain socket at `path` as well, or
+    // instead of the TCP port when `tcp` is false. Meant for a reverse proxy
+    // on the same host: requests on it take their client address from
+    // X-Real-IP or X-Forwarded-For.
+    void setUnixSocket(const string& path, bool tcp = true, mode_t mode = 0666) {
+        unix_path = path;
+        unix_mode = mode;
+        tcp_enabled = tcp;
+    }
+
+    // Serves HTTPS on the TCP port; the Unix socket stays plaintext. TLS 1.2
+    // and 1.3, with session resumption, ALPN for HTTP/2, and kernel TLS
+    // where the kernel and OpenSSL support it. Link with -lssl -lcrypto.
+    void enableTls(const string& cert_file, const string& key_file) {
+        tls_cert_file = cert_file;
+        tls_key_file = key_file;
+    }
+
+    void setMaxBodySize(size_t bytes) {
+        max_body_size = bytes;
+    }
+
+    void setMaxUploadSize(size_t bytes) {
+        max_upload_size = bytes;
+    }
+
+    void setUploadDir(const string& dir) {
+        upload_dir = dir;
+    }
+
+    void setCompression(bool enabled, int level = 6) {
+        compression = enabled;
+        compression_level = std::clamp(level, 1, 9);
+    }
+
+    // Bodies of this content type (or type prefix such as "text/") smaller
+    // than `min_bytes` are sent uncompressed.
+    void setCompressionThreshold(const string& content_type, size_t min_bytes) {
+        compression_thresholds[content_type] = min_bytes;
+    }
+
+    void setCompressionCacheSize(size_t bytes) {
+        compressed_cache.setMaxBytes(bytes);
+    }
+
+    // Memory for routes cached with a cache_policy (default 64 MB).
+    void setResponseCacheSize(size_t bytes) {
+        response_cache.setMaxBytes(bytes);
+    }
+
+    void setMaxQueueDepth(size_t depth, int retry_after_seconds = 1) {
+        max_queue_depth = depth;
+        retry_after = retry_after_seconds;
+
+        string body = "<h1>" + string(status_reason(503)) + "</h1>";
+        shed_response = "HTTP/1.1 503 " + string(status_reason(503)) + "\r\n"
+            "Content-Type: text/html; charset=utf-8\r\n"
+            "Retry-After: " + to_string(retry_after) + "\r\n"
+            "Content-Length: " + to_string(body.size()) + "\r\n"
+            "Connection: close\r\n\r\n" + body;
+    }
+
+    uint64_t shedConnections() const {
+        return shed_connections.load(std::memory_order_relaxed);
+    }
+
+    uint64_t shedRequests() const {
+        return shed_requests.load(std::memory_order_relaxed);
+    }
+
+    // Access log lines go to stdout unless `path` is given. LogFormat::Off
+    // turns the log off.
+    void setAccessLog(LogFormat format, const string& path = "") {
+        access_log.open(format, path);
+    }
+
+    // Log records dropped because the writer thread fell behind.
+    uint64_t accessLogDropped() const {
+        return access_log.dropped();
+    }
+
+    // Serves Prometheus metrics on `path` and starts recording per-route
+    // latency and status codes.
+    void enableMetrics(const string& path = "/metrics") {
+        metrics_enabled = true;
+        unmatched_metrics = std::make_unique<RouteMetrics>();
+        for (auto* routes : {&routesGET, &routesPOST}) {
+            for (auto& route : *routes) {
+                if (!route.metrics) route.metrics = std::make_shared<RouteMetrics>();
+            }
         }
 
-        sockaddr_in addr{};
-        addr.sin_family = AF_INET;
-        addr.sin_addr.s_addr = INADDR_ANY;
-        addr.sin_port = htons(port);
+        get(path, [this](const http_request&) {
+            http_response res(renderMetrics());
+            res.contentType = "text/plain; version=0.0.4";
+            return res;
+        });
+    }
 
-        if (::bind(server_fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
-            perror("bind"); close(server_fd); return;
+    void start() {
+        // sendfile() and OpenSSL's socket writes can't pass MSG_NOSIGNAL, so
+        // a client hanging up mid-response would otherwise kill the process.
+        signal(SIGPIPE, SIG_IGN);
+
+        if (!tls_cert_file.empty()) {
+            tls = std::make_unique<TlsContext>();
+            if (!tls->init(tls_cert_file, tls_key_file, http2)) return;
         }
 
-        if (listen(server_fd, 128) < 0) {
-            perror("listen"); close(server_fd); return;
+        // One Unix listener is shared by every shard; each accepts from it.
+        int unix_fd = -1;
+        if (!unix_path.empty()) {
+            unix_fd = openUnixListener();
+            if (unix_fd < 0) return;
         }
 
-        cout << "Server running at " << PROTOCOL << "://" << IP << ":" << port << " (threaded)" << "\n";
-        cout << "Worker threads: " << (int)pool.pending_tasks() + 4 << "\n";
+        bool reuse_port = loops.size() > 1;
+        for (auto& loop : loops) {
+            int server_fd = -1;
+            if (tcp_enabled) {
+                server_fd = openListener(reuse_port);
+                if (server_fd < 0) return;
+            }
 
-        while (true) {
-            sockaddr_in client_addr{};
-            socklen_t client_addr_len = sizeof(client_addr);
-            int client_fd = accept(server_fd, (sockaddr*)&client_addr, &client_addr_len);
-            if (client_fd < 0) { 
-                cerr << "[ERROR] Accept failed" << endl;
-                continue; 
+            if (!openEventLoop(*loop, server_fd, unix_fd)) {
+                if (server_fd >= 0) close(server_fd);
+                return;
             }
+        }
 
-            struct timeval tv;
-            tv.tv_sec = 30;
-            tv.tv_usec = 0;
-            setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
-            setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, (const char*)&tv, sizeof tv);
+        size_t workers = 0;
+        for (auto& loop : loops) {
+            workers += loop->pool.size();
+        }
 
-            try {
-                pool.enqueue([this, client_fd, client_addr]() {
-                    this->handleClient(client_fd, client_addr);
-                    close(client_fd);
-                });
-            } catch(const std::exception& e) {
-                cerr << "[ERROR] Failed to queue task: " << e.what() << endl;
-                close(client_fd);
-            }
+        const char* io = loops[0]->ring ? "io_uring" : "epoll";
+        if (tcp_enabled) {
+            cout << "Server running at " << (tls ? "https" : PROTOCOL) << "://" << IP << ":" << port << " (" << io << ")" << "\n";
+        }
+        if (unix_fd >= 0) {
+            cout << "Server running at unix:" << unix_path << " (" << io << ")" << "\n";
+        }
+        cout << "Shards: " << loops.size() << ", worker threads: " << workers << endl;
+
+        access_log.start();
+
+        std::vector<std::thread> shards;
+        for (size_t i = 1; i < loops.size(); ++i) {
+            EventLoop* loop = loops[i].get();
+            shards.emplace_back([this, loop] {
+                pin_current_thread(loop->cpu);
+                runLoop(*loop);
+            });
+        }
+
+        pin_current_thread(loops[0]->cpu);
+        runLoop(*loops[0]);
+
+        for (auto& shard : shards) {
+            shard.join();
         }
     }
 
 private:
+    static constexpr int IDLE_TIMEOUT_SECONDS = 30;
+    static constexpr int LINGER_TIMEOUT_SECONDS = 2;
+    static constexpr uint64_t TIMER_TICK_MS = 100;
+    static constexpr size_t MAX_HEADER_SIZE = 65536;
+    static constexpr size_t MAX_HEADER_COUNT = 100;
+    static constexpr size_t READ_BUDGET = 256 * 1024; // per connection per readiness event
+    static constexpr size_t BODY_PREALLOC = 64 * 1024; // buffer reserved for a body before it arrives
+    static constexpr int PIPELINE_DEPTH = 16;
+    static constexpr size_t PIPELINE_MAX_PENDING_OUTPUT = 1 << 20;
+    static constexpr unsigned URING_ENTRIES = 4096;
+    static constexpr size_t MAX_CACHED_FILE_SIZE = 4 * 1024 * 1024;
+    static constexpr int CACHED_COMPRESSION_LEVEL = 9;
+    static constexpr size_t H2_OUTPUT_BATCH = 256 * 1024;
+    static constexpr size_t H2_BODY_CHUNK = 64 * 1024;
+
+    struct PendingResponse {
+        bool keep_alive;
+        string head;
+        string body;
+        std::shared_ptr<const string> shared_body;
+        std::shared_ptr<FileBody> file;
+        std::shared_ptr<StreamBody> stream;
+        bool chunked = false;
+        std::vector<std::pair<string, string>> fields; // HTTP/2 responses send these instead of `head`
+    };
+
+    struct OutputChunk {
+        string head;
+        string body;
+        std::shared_ptr<const string> shared_body; // sent instead of `body` when set
+        size_t offset = 0;
+        std::shared_ptr<FileBody> file;
+        off_t file_offset = 0;
+        std::shared_ptr<StreamBody> stream;
+        bool chunked = false;
+        bool pulling = false;
+
+        std::string_view bodyView() const { return shared_body ? std::string_view(*shared_body) : std::string_view(body); }
+        size_t size() const { return head.size() + bodyView().size(); }
+        bool fileDone() const { return !file || (size_t)file_offset >= file->size; }
+        bool streamDone() const { return !stream; }
+    };
+
+    // The part of an HTTP/2 response body that is read from disk or produced
+    // as the stream's flow control window allows.
+    struct Http2Body {
+        std::shared_ptr<FileBody> file;
+        off_t offset = 0;
+        std::shared_ptr<StreamBody> stream;
+        bool pulling = false;
+    };
+
+    // What a connection is waiting for, which decides its timeout.
+    enum class Deadline { None, Header, Body, Handler, Write, KeepAlive, Linger };
+
+    struct UringOp;
+
+    struct Connection : TimerNode {
+        int fd = -1;
+        uint64_t id = 0;
+        string remote_addr;
+        bool proxied = false; // accepted on the Unix socket
+        std::unique_ptr<TlsConnection> tls;
+        RequestBuffer in;
+        size_t scan_offset = 0;
+        size_t head_size = 0;
+        size_t content_length = 0;
+        http_request pending;
+        std::shared_ptr<char[]> pending_storage;
+        std::unique_ptr<MultipartParser> upload;
+        size_t upload_remaining = 0;
+        std::deque<OutputChunk> out;
+        size_t out_pending = 0;
+        int requests_served = 0;
+        int in_flight = 0;
+        uint64_t next_seq = 0;
+        uint64_t write_seq = 0;
+        std::map<uint64_t, PendingResponse> ready;
+        std::set<uint64_t> abandoned; // seqs answered with a 504 while their handler ran on
+        bool barrier = false;
+        bool draining = false;
+        bool peer_closed = false;
+        bool close_after_write = false;
+        bool lingering = false;
+        bool write_armed = false;
+        UringOp* send_op = nullptr; // io_uring: a sendmsg of `out` in flight
+        bool read_paused = false; // at inputLimit() with the socket not drained
+        Deadline deadline = Deadline::None;
+        std::unique_ptr<Http2Session> h2;
+        std::map<uint32_t, Http2Body> h2_bodies;
+
+        Connection(BufferPool* pool) : in(pool) {}
+    };
+
+    struct Completion {
+        int fd;
+        uint64_t id;
+        uint64_t seq;
+        PendingResponse response;
+    };
+
+    struct StreamPiece {
+        int fd;
+        uint64_t id;
+        string data;
+        bool last = false;
+        bool failed = false;
+        uint32_t h2_stream = 0;
+    };
+
+    // A submitted io_uring operation; its address is the SQE's user_data.
+    // Accept, Recv and Send fall back to a POLL_ADD when the kernel reports
+    // -EAGAIN and are resubmitted once the poll fires.
+    struct UringOp {
+        enum Kind { Accept, Wake, Recv, Send, Writable, Tick };
+
+        Kind kind;
+        int fd;
+        uint64_t id = 0;
+        bool polling = false;
+        std::unique_ptr<char[]> block;
+        sockaddr_in addr{};
+        socklen_t addr_len = sizeof(sockaddr_in);
+        UringTimespec timeout{1, 0};
+        std::vector<iovec> iov; // Send: points into the connection's output
+        msghdr msg{};
+        std::deque<OutputChunk> orphaned; // output of a connection closed mid-send
+
+        UringOp(Kind kind, int fd) : kind(kind), fd(fd) {}
+    };
+
+    struct EventLoop {
+        int cpu;
+        int epoll_fd = -1;
+        int listen_fd = -1;
+        int unix_fd = -1;
+        int wake_fd = -1;
+        uint64_t next_id = 1;
+        BufferPool buffers;
+        std::unique_ptr<IoUring> ring;
+        std::unordered_map<int, std::unique_ptr<Connection>> connections;
+        std::mutex completed_mutex;
+        std::vector<Completion> completed;
+        std::vector<StreamPiece> streamed;
+        std::vector<std::pair<int, uint64_t>> resume_reads; // epoll: connections to read again
+        TimerWheel timers{currentTick()};
+        ThreadPool pool;
+
+        // Written by this loop's thread only, read by /metrics.
+        std::atomic<int64_t> open_connections{0};
+        std::atomic<uint64_t> bytes_in{0};
+        std::atomic<uint64_t> bytes_out{0};
+
+        EventLoop(size_t num_workers, int cpu) : cpu(cpu), pool(num_workers, cpu) {}
+    };
+
     int port;
-    ThreadPool pool;
-    std::vector<std::pair<RoutePattern, route_handler>> routesGET;
-    std::vector<std::pair<RoutePattern, route_handler>> routesPOST;
+    IoBackend backend;
+    AccessLog access_log; // declared before the loops so it outlives their workers
+    std::vector<std::unique_ptr<EventLoop>> loops;
+    int keep_alive_timeout = 5;
+    int keep_alive_max_requests = 100;
+    int header_timeout = 10;
+    int handler_timeout = 0;
+    bool http2 = true;
+    bool tcp_enabled = true;
+    string unix_path;
+    mode_t unix_mode = 0666;
+    string tls_cert_file;
+    string tls_key_file;
+    std::unique_ptr<TlsContext> tls;
+    std::atomic<uint64_t> tls_handshakes{0};
+    std::atomic<uint64_t> tls_resumed{0};
+    std::atomic<uint64_t> tls_kernel{0};
+    size_t max_body_size = 8 * 1024 * 1024;
+    size_t max_upload_size = 1024 * 1024 * 1024;
+    string upload_dir = "/tmp";
+    bool compression = true;
+    int compression_level = 6;
+    std::map<string, size_t> compression_thresholds = {
+        {"text/", 1024},
+        {"application/json", 1024},
+        {"application/javascript", 1024},
+        {"application/xml", 1024},
+        {"image/svg+xml", 1024},
+    };
+    CompressedCache compressed_cache;
+    ResponseCache response_cache;
+    size_t max_queue_depth = 0;
+    int retry_after = 1;
+    string shed_response;
+    std::atomic<uint64_t> shed_connections{0};
+    std::atomic<uint64_t> shed_requests{0};
+    bool metrics_enabled = false;
+
+    struct RouteMetrics {
+        Histogram latency;
+        Counter responses[5]; // by status class, 1xx to 5xx
+    };
+
+    struct Route {
+        RoutePattern pattern;
+        route_handler handler;
+        deferred_handler deferred;
+        std::shared_ptr<RouteMetrics> metrics;
+        std::shared_ptr<const cache_policy> cache;
+    };
+
+    std::vector<Route> routesGET;
+    std::vector<Route> routesPOST;
     route_handler fallback;
+    std::unique_ptr<RouteMetrics> unmatched_metrics;
+
+    void addRoute(std::vector<Route>& routes, const string& path, route_handler h, deferred_handler d) {
+        auto metrics = metrics_enabled ? std::make_shared<RouteMetrics>() : nullptr;
+        routes.push_back({RoutePattern(path), std::move(h), std::move(d), std::move(metrics), nullptr});
+    }
 
-    string getCurrentTime() {
-        time_t now = time(0);
-        tm* timeinfo = localtime(&now);
-        char buffer[80];
-        strftime(buffer, sizeof(buffer), "%d/%b/%Y %H:%M:%S", timeinfo);
-        return string(buffer);
+    template <typename Handler>
+    static deferred_handler deferred(Handler h) {
+        return [h](http_request& req, response_callback done) mutable {
+            h(req).start(std::move(done));
+        };
     }
 
     string loadFile(const string& filepath) {
@@ -287,175 +1092,2245 @@ private:
         return buffer.str();
     }
 
-    void handleClient(int client_fd, sockaddr_in client_addr) {
-        char buffer[8192] = {0};
-        ssize_t bytes_read = read(client_fd, buffer, sizeof(buffer) - 1);
-        if (bytes_read < 0) {
-            if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                perror("[ERROR] read");
-            }
-            return;
+    int openListener(bool reuse_port) {
+        int server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (server_fd < 0) { perror("socket"); return -1; }
+
+        int opt = 1;
+        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+            perror("setsockopt");
+            close(server_fd);
+            return -1;
         }
 
-        if (bytes_read == 0) {
-            return;
+        if (reuse_port && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+            perror("setsockopt");
+            close(server_fd);
+            return -1;
         }
 
-        http_request req;
-        req.raw = buffer;
-        req.remote_addr = inet_ntoa(client_addr.sin_addr);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = INADDR_ANY;
+        addr.sin_port = htons(port);
 
-        istringstream iss(buffer);
-        iss >> req.method >> req.path;
-        
-        string full_request(buffer, bytes_read);
-        
-        size_t body_start = full_request.find("\r\n\r\n");
-        string headers_part;
-        
-        if (body_start != string::npos) {
-            headers_part = full_request.substr(0, body_start);
-            req.body = full_request.substr(body_start + 4);
-            
-            size_t content_length_pos = headers_part.find("Content-Length: ");
-            if (content_length_pos != string::npos) {
-                size_t eol = headers_part.find("\r\n", content_length_pos);
-                string content_length_str = headers_part.substr(
-                    content_length_pos + 16,
-                    eol - (content_length_pos + 16)
-                );
-                int content_length = stoi(content_length_str);
-                if (req.body.length() > (size_t)content_length) {
-                    req.body = req.body.substr(0, content_length);
+        if (::bind(server_fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+            perror("bind"); close(server_fd); return -1;
+        }
+
+        if (listen(server_fd, SOMAXCONN) < 0) {
+            perror("listen"); close(server_fd); return -1;
+        }
+
+        return server_fd;
+    }
+
+    int openUnixListener() {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (unix_path.size() >= sizeof(addr.sun_path)) {
+            cerr << "[ERROR] Unix socket path is too long: " << unix_path << endl;
+            return -1;
+        }
+        memcpy(addr.sun_path, unix_path.c_str(), unix_path.size() + 1);
+
+        int server_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (server_fd < 0) { perror("socket"); return -1; }
+
+        // A socket file left behind by an earlier run would make bind fail.
+        struct stat st;
+        if (lstat(unix_path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+            unlink(unix_path.c_str());
+        }
+
+        if (::bind(server_fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+            perror("bind"); close(server_fd); return -1;
+        }
+
+        if (chmod(unix_path.c_str(), unix_mode) < 0) {
+            perror("chmod"); close(server_fd); return -1;
+        }
+
+        if (listen(server_fd, SOMAXCONN) < 0) {
+            perror("listen"); close(server_fd); return -1;
+        }
+
+        return server_fd;
+    }
+
+    bool openEventLoop(EventLoop& loop, int listen_fd, int unix_fd) {
+        loop.listen_fd = listen_fd;
+        loop.unix_fd = unix_fd;
+
+        if (backend == IoBackend::IoUring) {
+            if (openUring(loop)) return true;
+            cerr << "[WARN] io_uring is not available, falling back to epoll" << endl;
+        }
+
+        loop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop.epoll_fd < 0) {
+            perror("epoll_create1");
+            return false;
+        }
+
+        loop.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (loop.wake_fd < 0) {
+            perror("eventfd");
+            close(loop.epoll_fd);
+            return false;
+        }
+
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = listen_fd;
+        if (listen_fd >= 0 && epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+            perror("epoll_ctl");
+            close(loop.wake_fd);
+            close(loop.epoll_fd);
+            return false;
+        }
+
+        // Exclusive, so a connection on the shared socket wakes one shard rather than all of them.
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.fd = unix_fd;
+        if (unix_fd >= 0 && epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, unix_fd, &ev) < 0) {
+            perror("epoll_ctl");
+            close(loop.wake_fd);
+            close(loop.epoll_fd);
+            return false;
+        }
+
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.fd = loop.wake_fd;
+        if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, loop.wake_fd, &ev) < 0) {
+            perror("epoll_ctl");
+            close(loop.wake_fd);
+            close(loop.epoll_fd);
+            return false;
+        }
+
+        return true;
+    }
+
+    bool openUring(EventLoop& loop) {
+        auto ring = std::make_unique<IoUring>();
+        if (!ring->init(URING_ENTRIES)) return false;
+
+        loop.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (loop.wake_fd < 0) {
+            perror("eventfd");
+            return false;
+        }
+
+        loop.ring = std::move(ring);
+        return true;
+    }
+
+    void runLoop(EventLoop& loop) {
+        if (loop.ring) {
+            runUringLoop(loop);
+        } else {
+            runEventLoop(loop);
+        }
+    }
+
+    void runEventLoop(EventLoop& loop) {
+        std::vector<epoll_event> events(256);
+
+        while (true) {
+            int wait_ms = loop.resume_reads.empty() ? timerWait(loop) : 0;
+            int n = epoll_wait(loop.epoll_fd, events.data(), (int)events.size(), wait_ms);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                perror("epoll_wait");
+                return;
+            }
+
+            for (int i = 0; i < n; ++i) {
+                int fd = events[i].data.fd;
+                uint32_t flags = events[i].events;
+
+                if (fd == loop.listen_fd || fd == loop.unix_fd) {
+                    acceptConnections(loop, fd);
+                    continue;
+                }
+
+                if (fd == loop.wake_fd) {
+                    drainCompletions(loop);
+                    continue;
+                }
+
+                auto it = loop.connections.find(fd);
+                if (it == loop.connections.end()) continue;
+                Connection& conn = *it->second;
+                uint64_t id = conn.id;
+
+                if (flags & EPOLLERR) {
+                    closeConnection(loop, conn);
+                    continue;
+                }
+
+                if ((flags & EPOLLOUT) && !flushConnection(loop, conn)) continue;
+
+                if (flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+                    readConnection(loop, conn);
+                }
+                refreshTimer(loop, fd, id);
+            }
+
+            // Edge-triggered epoll won't report bytes left in these sockets again.
+            std::vector<std::pair<int, uint64_t>> resume;
+            resume.swap(loop.resume_reads);
+            for (auto [fd, id] : resume) {
+                Connection* conn = findConnection(loop, fd, id);
+                if (!conn) continue;
+                readConnection(loop, *conn);
+                refreshTimer(loop, fd, id);
+            }
+
+            expireTimers(loop);
+        }
+    }
+
+    void runUringLoop(EventLoop& loop) {
+        // Without a bounded wait, a repeating timeout op wakes the loop every tick.
+        bool timed_wait = loop.ring->supportsWaitTimeout();
+        UringOp* tick = new UringOp(UringOp::Tick, -1);
+        tick->timeout = {0, (long long)TIMER_TICK_MS * 1000000};
+
+        if ((loop.listen_fd >= 0 && !submitOp(loop, new UringOp(UringOp::Accept, loop.listen_fd)))
+            || (loop.unix_fd >= 0 && !submitOp(loop, new UringOp(UringOp::Accept, loop.unix_fd)))
+            || !submitOp(loop, new UringOp(UringOp::Wake, loop.wake_fd))
+            || (!timed_wait && !submitOp(loop, tick))) {
+            cerr << "[ERROR] Failed to queue io_uring operation" << endl;
+            return;
+        }
+        if (timed_wait) delete tick;
+
+        while (true) {
+            int wait_ms = timed_wait ? timerWait(loop) : -1;
+            if (loop.ring->submitAndWait(1, wait_ms) < 0
+                && errno != EINTR && errno != EAGAIN && errno != EBUSY && errno != ETIME) {
+                perror("io_uring_enter");
+                return;
+            }
+
+            loop.ring->forEachCompletion([&](void* data, int res) {
+                completeOp(loop, static_cast<UringOp*>(data), res);
+            });
+
+            expireTimers(loop);
+        }
+    }
+
+    bool submitOp(EventLoop& loop, UringOp* op) {
+        IoUring& ring = *loop.ring;
+        if (op->polling) {
+            return ring.poll(op->fd, op->kind == UringOp::Send ? POLLOUT : POLLIN, op);
+        }
+
+        switch (op->kind) {
+            case UringOp::Accept:
+                op->addr_len = sizeof(op->addr);
+                return ring.accept(op->fd, (sockaddr*)&op->addr, &op->addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC, op);
+            case UringOp::Recv:
+                return ring.recv(op->fd, op->block.get(), BufferPool::BLOCK_SIZE, op);
+            case UringOp::Send:
+                return ring.sendmsg(op->fd, &op->msg, MSG_NOSIGNAL, op);
+            case UringOp::Wake:
+                return ring.poll(op->fd, POLLIN, op);
+            case UringOp::Writable:
+                return ring.poll(op->fd, POLLOUT, op);
+            case UringOp::Tick:
+                return ring.timeout(&op->timeout, op);
+        }
+        return false;
+    }
+
+    void freeOp(EventLoop& loop, UringOp* op) {
+        if (op->block) {
+            loop.buffers.release(std::move(op->block));
+        }
+        delete op;
+    }
+
+    Connection* findConnection(EventLoop& loop, int fd, uint64_t id) {
+        auto it = loop.connections.find(fd);
+        if (it == loop.connections.end() || it->second->id != id) return nullptr;
+        return it->second.get();
+    }
+
+    bool startRecv(EventLoop& loop, Connection& conn) {
+        UringOp* op = new UringOp(UringOp::Recv, conn.fd);
+        op->id = conn.id;
+        op->block = loop.buffers.acquire();
+        if (submitOp(loop, op)) return true;
+
+        freeOp(loop, op);
+        cerr << "[ERROR] Failed to queue io_uring operation" << endl;
+        closeConnection(loop, conn);
+        return false;
+    }
+
+    void armWritable(EventLoop& loop, Connection& conn) {
+        if (!loop.ring || conn.write_armed) return;
+
+        UringOp* op = new UringOp(UringOp::Writable, conn.fd);
+        op->id = conn.id;
+        if (!submitOp(loop, op)) {
+            freeOp(loop, op);
+            cerr << "[ERROR] Failed to queue io_uring operation" << endl;
+            closeConnection(loop, conn);
+            return;
+        }
+        conn.write_armed = true;
+    }
+
+    void completeOp(EventLoop& loop, UringOp* op, int res) {
+        bool retryable = op->kind == UringOp::Accept || op->kind == UringOp::Recv || op->kind == UringOp::Send;
+        if (op->polling || (retryable && res == -EAGAIN)) {
+            op->polling = !op->polling;
+            if (op->kind != UringOp::Accept && !findConnection(loop, op->fd, op->id)) {
+                freeOp(loop, op);
+            } else if (!submitOp(loop, op)) {
+                cerr << "[ERROR] Failed to queue io_uring operation" << endl;
+                freeOp(loop, op);
+            }
+            return;
+        }
+
+        switch (op->kind) {
+            case UringOp::Accept:
+                if (res >= 0) {
+                    Connection* conn = addConnection(loop, res, op->fd == loop.unix_fd ? nullptr : &op->addr);
+                    if (conn) startRecv(loop, *conn);
+                } else if (res != -EINTR && res != -ECONNABORTED) {
+                    cerr << "[ERROR] Accept failed: " << strerror(-res) << endl;
+                }
+                break;
+
+            case UringOp::Wake:
+                drainCompletions(loop);
+                break;
+
+            case UringOp::Tick:
+                break;
+
+            case UringOp::Writable: {
+                Connection* conn = findConnection(loop, op->fd, op->id);
+                int fd = op->fd;
+                uint64_t id = op->id;
+                freeOp(loop, op);
+                if (conn) {
+                    conn->write_armed = false;
+                    flushConnection(loop, *conn);
+                    refreshTimer(loop, fd, id);
+                }
+                return;
+            }
+
+            case UringOp::Recv:
+                completeRecv(loop, op, res);
+                return;
+
+            case UringOp::Send:
+                completeSend(loop, op, res);
+                return;
+        }
+
+        if (!submitOp(loop, op)) {
+            cerr << "[ERROR] Failed to queue io_uring operation" << endl;
+            freeOp(loop, op);
+        }
+    }
+
+    void completeRecv(EventLoop& loop, UringOp* op, int res) {
+        Connection* conn = findConnection(loop, op->fd, op->id);
+        if (!conn || res == -EINTR) {
+            if (!conn || !submitOp(loop, op)) freeOp(loop, op);
+            return;
+        }
+
+        if (res < 0) {
+            freeOp(loop, op);
+            cerr << "[ERROR] read: " << strerror(-res) << endl;
+            closeConnection(loop, *conn);
+            return;
+        }
+
+        int fd = conn->fd;
+        uint64_t id = conn->id;
+        if (res == 0) {
+            freeOp(loop, op);
+            conn->peer_closed = true;
+            processInput(loop, *conn);
+            refreshTimer(loop, fd, id);
+            return;
+        }
+
+        if (conn->draining) {
+            conn->in.reset();
+        }
+        loop.bytes_in.fetch_add(res, std::memory_order_relaxed);
+        if (conn->tls) {
+            if (!decryptInput(loop, *conn, op->block.get(), res)) {
+                freeOp(loop, op);
+                return;
+            }
+        } else {
+            if (conn->in.writable() < (size_t)res) {
+                conn->in.reserve(conn->in.size() + res);
+            }
+            memcpy(conn->in.writePtr(), op->block.get(), res);
+            conn->in.commit(res);
+        }
+
+        // The staging block is free again, so the next recv can be queued
+        // before the request is parsed and dispatched, unless the buffer is
+        // full; then receiving resumes once dispatch has drained it.
+        if (conn->in.size() >= inputLimit(*conn)) {
+            freeOp(loop, op);
+            conn->read_paused = true;
+        } else if (!submitOp(loop, op)) {
+            freeOp(loop, op);
+            cerr << "[ERROR] Failed to queue io_uring operation" << endl;
+            closeConnection(loop, *conn);
+            return;
+        }
+        if (!processInput(loop, *conn) || !resumeReading(loop, *conn)) return;
+        refreshTimer(loop, fd, id);
+    }
+
+    void completeSend(EventLoop& loop, UringOp* op, int res) {
+        Connection* conn = findConnection(loop, op->fd, op->id);
+        freeOp(loop, op);
+        if (!conn) return;
+
+        conn->send_op = nullptr;
+        int fd = conn->fd;
+        uint64_t id = conn->id;
+        if (res >= 0) {
+            advanceOutput(*conn, res);
+            loop.bytes_out.fetch_add(res, std::memory_order_relaxed);
+        } else if (res != -EINTR) {
+            cerr << "[ERROR] Failed to write response" << endl;
+            closeConnection(loop, *conn);
+            return;
+        }
+        if (flushConnection(loop, *conn)) refreshTimer(loop, fd, id);
+    }
+
+    void acceptConnections(EventLoop& loop, int listen_fd) {
+        while (true) {
+            sockaddr_in client_addr{};
+            socklen_t client_addr_len = sizeof(client_addr);
+            int client_fd = accept4(listen_fd, (sockaddr*)&client_addr, &client_addr_len,
+                                    SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (client_fd < 0) {
+                if (errno == EINTR) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    cerr << "[ERROR] Accept failed: " << strerror(errno) << endl;
+                }
+                return;
+            }
+
+            addConnection(loop, client_fd, listen_fd == loop.unix_fd ? nullptr : &client_addr);
+        }
+    }
+
+    // `client_addr` is null for connections on the Unix socket.
+    Connection* addConnection(EventLoop& loop, int client_fd, const sockaddr_in* client_addr) {
+        if (isOverloaded(loop)) {
+            shedConnection(client_fd, !client_addr || !tls);
+            return nullptr;
+        }
+
+        auto conn = std::make_unique<Connection>(&loop.buffers);
+        conn->fd = client_fd;
+        conn->id = loop.next_id++;
+
+        if (client_addr) {
+            int one = 1;
+            setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+            char ip[INET_ADDRSTRLEN] = {0};
+            inet_ntop(AF_INET, &client_addr->sin_addr, ip, sizeof(ip));
+            conn->remote_addr = ip;
+
+            if (tls) {
+                conn->tls = std::make_unique<TlsConnection>(*tls, client_fd);
+                if (!conn->tls->valid()) {
+                    cerr << "[ERROR] Failed to set up TLS for a connection" << endl;
+                    close(client_fd);
+                    return nullptr;
+                }
+            }
+        } else {
+            conn->remote_addr = "unix";
+            conn->proxied = true;
+        }
+
+        if (!loop.ring) {
+            epoll_event ev{};
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            ev.data.fd = client_fd;
+            if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+                perror("epoll_ctl");
+                close(client_fd);
+                return nullptr;
+            }
+        }
+
+        Connection* added = conn.get();
+        loop.connections[client_fd] = std::move(conn);
+        loop.open_connections.fetch_add(1, std::memory_order_relaxed);
+        refreshTimer(loop, *added);
+        return added;
+    }
+
+    bool isOverloaded(EventLoop& loop) {
+        return max_queue_depth > 0 && loop.pool.pending_tasks() >= max_queue_depth;
+    }
+
+    // A TLS client expects a ServerHello, which a plaintext 503 would only
+    // garble, so those connections are closed without a reply.
+    void shedConnection(int client_fd, bool respond) {
+        shed_connections.fetch_add(1, std::memory_order_relaxed);
+        if (respond && send(client_fd, shed_response.data(), shed_response.size(), MSG_NOSIGNAL | MSG_DONTWAIT) < 0
+            && errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("[ERROR] send");
+        }
+        close(client_fd);
+    }
+
+    void closeConnection(EventLoop& loop, Connection& conn) {
+        int fd = conn.fd;
+        if (loop.ring) {
+            // Queued SQEs name the socket by number. Submit them while it is
+            // still this socket's, not one that another shard's accept gets next.
+            if (loop.ring->hasUnsubmitted()) loop.ring->submitAndWait(0);
+            // Completes any recv or poll still parked on the socket so its op is freed.
+            shutdown(fd, SHUT_RDWR);
+            // The kernel may still be reading a queued send from these buffers.
+            if (conn.send_op) conn.send_op->orphaned = std::move(conn.out);
+        }
+        close(fd);
+        loop.timers.cancel(conn);
+        if (loop.connections.erase(fd)) {
+            loop.open_connections.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+
+    void readConnection(EventLoop& loop, Connection& conn) {
+        thread_local char ciphertext[BufferPool::BLOCK_SIZE];
+        size_t budget = READ_BUDGET;
+        conn.read_paused = false;
+
+        while (true) {
+            if (conn.draining) {
+                conn.in.reset();
+            }
+
+            size_t limit = inputLimit(conn);
+            if (conn.in.size() >= limit || budget == 0) {
+                // Parse and dispatch what is buffered before reading on.
+                if (!processInput(loop, conn)) return;
+                if (budget > 0 && conn.in.size() < inputLimit(conn)) continue;
+                if (budget == 0) {
+                    loop.resume_reads.emplace_back(conn.fd, conn.id);
+                } else {
+                    conn.read_paused = true;
+                }
+                return;
+            }
+
+            if (!conn.tls && conn.in.writable() == 0) {
+                conn.in.reserve(conn.in.size() + BufferPool::BLOCK_SIZE / 4);
+            }
+
+            // TLS input is read aside and decrypted into conn.in.
+            char* buffer = conn.tls ? ciphertext : conn.in.writePtr();
+            size_t capacity = conn.tls ? sizeof(ciphertext) : std::min(conn.in.writable(), limit - conn.in.size());
+            ssize_t bytes_read = read(conn.fd, buffer, std::min(capacity, budget));
+            if (bytes_read > 0) {
+                budget -= bytes_read;
+                loop.bytes_in.fetch_add(bytes_read, std::memory_order_relaxed);
+                if (!conn.tls) {
+                    conn.in.commit(bytes_read);
+                } else if (!decryptInput(loop, conn, buffer, bytes_read)) {
+                    return;
+                }
+                // Feed uploads as bytes arrive so the buffer never holds more than one read.
+                if (conn.upload && !dispatchRequests(loop, conn)) return;
+                continue;
+            }
+            if (bytes_read == 0) {
+                conn.peer_closed = true;
+                break;
+            }
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+
+            perror("[ERROR] read");
+            closeConnection(loop, conn);
+            return;
+        }
+
+        processInput(loop, conn);
+    }
+
+    // Unparsed input a connection may buffer before reading stops: the whole
+    // request once its head is parsed, otherwise one byte past the largest
+    // head, where extractRequest() answers 431. Uploads are parsed on every
+    // read, so they never fill the buffer.
+    size_t inputLimit(const Connection& conn) const {
+        if (conn.head_size > 0 && !conn.upload) return conn.head_size + conn.content_length;
+        return MAX_HEADER_SIZE + 1;
+    }
+
+    // Restarts reading on a connection paused at inputLimit() once dispatch
+    // has drained its buffer. False if the connection was closed.
+    bool resumeReading(EventLoop& loop, Connection& conn) {
+        if (!conn.read_paused || conn.in.size() >= inputLimit(conn)) return true;
+        conn.read_paused = false;
+        if (loop.ring) return startRecv(loop, conn);
+        loop.resume_reads.emplace_back(conn.fd, conn.id);
+        return true;
+    }
+
+    // Feeds ciphertext to the connection's TLS session and appends whatever
+    // it decrypts to conn.in. False if the connection was closed.
+    bool decryptInput(EventLoop& loop, Connection& conn, const char* data, size_t n) {
+        TlsConnection& session = *conn.tls;
+        bool handshaking = !session.handshakeDone();
+        if (n > 0) session.feed(data, n);
+
+        while (true) {
+            if (conn.in.writable() == 0) {
+                conn.in.reserve(conn.in.size() + BufferPool::BLOCK_SIZE / 4);
+            }
+            size_t decrypted = 0;
+            TlsConnection::Status status = session.read(conn.in.writePtr(), conn.in.writable(), decrypted);
+            conn.in.commit(decrypted);
+            if (status == TlsConnection::Ok) continue;
+
+            if (handshaking && session.handshakeDone()) {
+                tls_handshakes.fetch_add(1, std::memory_order_relaxed);
+                if (session.resumed()) tls_resumed.fetch_add(1, std::memory_order_relaxed);
+                if (session.kernelSend()) tls_kernel.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            switch (status) {
+                case TlsConnection::WantRead:
+                    return true;
+                case TlsConnection::WantWrite:
+                    armWritable(loop, conn);
+                    return true;
+                case TlsConnection::Closed:
+                    conn.peer_closed = true;
+                    return true;
+                default:
+                    // Failed handshakes are routine (scanners, plain HTTP), so they go unlogged.
+                    closeConnection(loop, conn);
+                    return false;
+            }
+        }
+    }
+
+    // False if the connection was closed.
+    bool processInput(EventLoop& loop, Connection& conn) {
+        if (conn.lingering) {
+            conn.in.reset();
+            if (conn.peer_closed) {
+                closeConnection(loop, conn);
+                return false;
+            }
+            return true;
+        }
+
+        return dispatchRequests(loop, conn);
+    }
+
+    void queueOutput(Connection& conn, string head, string body = "", std::shared_ptr<const string> shared_body = nullptr,
+                     std::shared_ptr<FileBody> file = nullptr, std::shared_ptr<StreamBody> stream = nullptr,
+                     bool chunked = false) {
+        OutputChunk chunk;
+        chunk.head = std::move(head);
+        chunk.body = std::move(body);
+        chunk.shared_body = std::move(shared_body);
+        conn.out_pending += chunk.size();
+        chunk.file = std::move(file);
+        chunk.stream = std::move(stream);
+        chunk.chunked = chunked;
+        conn.out.push_back(std::move(chunk));
+    }
+
+    // Points `iov` at the queued output, up to the first file or stream body
+    // that isn't sent yet. Returns the number of entries used.
+    static int gatherOutput(Connection& conn, iovec* iov) {
+        int count = 0;
+        for (auto& chunk : conn.out) {
+            if (count + 2 > IOV_MAX) break;
+
+            if (chunk.offset < chunk.head.size()) {
+                iov[count].iov_base = chunk.head.data() + chunk.offset;
+                iov[count].iov_len = chunk.head.size() - chunk.offset;
+                count++;
+            }
+            std::string_view body = chunk.bodyView();
+            size_t body_offset = chunk.offset > chunk.head.size() ? chunk.offset - chunk.head.size() : 0;
+            if (body_offset < body.size()) {
+                iov[count].iov_base = const_cast<char*>(body.data()) + body_offset;
+                iov[count].iov_len = body.size() - body_offset;
+                count++;
+            }
+            if (!chunk.fileDone() || !chunk.streamDone()) break;
+        }
+        return count;
+    }
+
+    static void advanceOutput(Connection& conn, size_t bytes_written) {
+        size_t remaining = bytes_written;
+        for (auto& chunk : conn.out) {
+            if (remaining == 0) break;
+            size_t take = std::min(remaining, chunk.size() - chunk.offset);
+            chunk.offset += take;
+            remaining -= take;
+        }
+        conn.out_pending -= bytes_written;
+    }
+
+    ssize_t writeChunks(Connection& conn) {
+        iovec iov[IOV_MAX];
+        int count = gatherOutput(conn, iov);
+
+        ssize_t bytes_written;
+        if (conn.tls && !conn.tls->kernelSend()) {
+            bytes_written = writeRecord(conn, iov, count);
+        } else {
+            msghdr msg{};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = count;
+            bytes_written = sendmsg(conn.fd, &msg, MSG_NOSIGNAL);
+        }
+        if (bytes_written <= 0) return bytes_written;
+
+        advanceOutput(conn, bytes_written);
+        return bytes_written;
+    }
+
+    // Hands the queued output to the ring as one sendmsg; completeSend()
+    // carries on from where the kernel stopped. False if the connection was
+    // closed.
+    bool submitSend(EventLoop& loop, Connection& conn) {
+        if (conn.send_op) return true;
+
+        iovec iov[IOV_MAX];
+        int count = gatherOutput(conn, iov);
+        UringOp* op = new UringOp(UringOp::Send, conn.fd);
+        op->id = conn.id;
+        op->iov.assign(iov, iov + count);
+        op->msg.msg_iov = op->iov.data();
+        op->msg.msg_iovlen = count;
+        if (!submitOp(loop, op)) {
+            freeOp(loop, op);
+            cerr << "[ERROR] Failed to queue io_uring operation" << endl;
+            closeConnection(loop, conn);
+            return false;
+        }
+        conn.send_op = op;
+        return true;
+    }
+
+    // Without kernel TLS every write goes through SSL_write, which seals one
+    // record per call; the pieces are packed into a full record first.
+    static ssize_t writeRecord(Connection& conn, const iovec* iov, int count) {
+        if (iov[0].iov_len >= TLS_RECORD_SIZE) {
+            return conn.tls->write(iov[0].iov_base, TLS_RECORD_SIZE);
+        }
+
+        thread_local char record[TLS_RECORD_SIZE];
+        size_t size = 0;
+        for (int i = 0; i < count && size < TLS_RECORD_SIZE; ++i) {
+            size_t take = std::min(iov[i].iov_len, TLS_RECORD_SIZE - size);
+            memcpy(record + size, iov[i].iov_base, take);
+            size += take;
+        }
+        return conn.tls->write(record, size);
+    }
+
+    ssize_t sendFile(Connection& conn, OutputChunk& chunk) {
+        size_t remaining = chunk.file->size - chunk.file_offset;
+        if (!conn.tls || conn.tls->kernelSend()) {
+            return sendfile(conn.fd, chunk.file->fd, &chunk.file_offset, remaining);
+        }
+
+        // A retry after EAGAIN reads the same bytes again, as SSL_write requires.
+        thread_local char record[TLS_RECORD_SIZE];
+        ssize_t bytes_read = pread(chunk.file->fd, record, std::min(remaining, TLS_RECORD_SIZE), chunk.file_offset);
+        if (bytes_read <= 0) return bytes_read;
+        ssize_t bytes_written = conn.tls->write(record, bytes_read);
+        if (bytes_written > 0) chunk.file_offset += bytes_written;
+        return bytes_written;
+    }
+
+    // Writes as much queued output as the socket takes. False if the
+    // connection was closed.
+    bool writeOutput(EventLoop& loop, Connection& conn) {
+        if (conn.tls && conn.tls->readBlocked()) {
+            // The handshake stalled on a full socket; reading again carries it on.
+            if (!decryptInput(loop, conn, nullptr, 0)) return false;
+            if (conn.tls->readBlocked()) return true;
+        }
+
+        while (!conn.out.empty()) {
+            OutputChunk& chunk = conn.out.front();
+            ssize_t bytes_written;
+
+            if (conn.send_op) {
+                return true;
+            } else if (chunk.offset < chunk.size()) {
+                if (loop.ring && (!conn.tls || conn.tls->kernelSend())) return submitSend(loop, conn);
+                bytes_written = writeChunks(conn);
+            } else if (!chunk.fileDone()) {
+                bytes_written = sendFile(conn, chunk);
+                if (bytes_written == 0) {
+                    cerr << "[ERROR] File shrank while being sent" << endl;
+                    closeConnection(loop, conn);
+                    return false;
+                }
+            } else if (!chunk.streamDone()) {
+                // Everything produced so far is on the wire; ask for the next piece.
+                if (!chunk.pulling) return pullStream(loop, conn, chunk);
+                return true;
+            } else {
+                conn.out.pop_front();
+                continue;
+            }
+
+            if (bytes_written > 0) {
+                loop.bytes_out.fetch_add(bytes_written, std::memory_order_relaxed);
+                continue;
+            }
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                armWritable(loop, conn);
+                return true;
+            }
+
+            cerr << "[ERROR] Failed to write response" << endl;
+            closeConnection(loop, conn);
+            return false;
+        }
+        return true;
+    }
+
+    bool flushConnection(EventLoop& loop, Connection& conn) {
+        if (!writeOutput(loop, conn)) return false;
+        if (!conn.out.empty()) return true;
+
+        if (conn.close_after_write) {
+            if (conn.peer_closed) {
+                closeConnection(loop, conn);
+                return false;
+            }
+            if (!conn.lingering) {
+                conn.lingering = true;
+                conn.in.reset();
+                if (conn.tls) conn.tls->close();
+                shutdown(conn.fd, SHUT_WR);
+            }
+            return true;
+        }
+        return dispatchRequests(loop, conn) && resumeReading(loop, conn);
+    }
+
+    static uint64_t currentTick() {
+        auto now = std::chrono::steady_clock::now().time_since_epoch();
+        return std::chrono::duration_cast<std::chrono::milliseconds>(now).count() / TIMER_TICK_MS;
+    }
+
+    // Milliseconds until the timer wheel next has work, for epoll_wait.
+    static int timerWait(EventLoop& loop) {
+        uint64_t next = loop.timers.nextTick();
+        if (next == TimerWheel::NEVER) return -1;
+        auto now = std::chrono::steady_clock::now().time_since_epoch();
+        uint64_t now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(now).count();
+        uint64_t due_ms = next * TIMER_TICK_MS;
+        return due_ms <= now_ms ? 0 : (int)std::min<uint64_t>(due_ms - now_ms, INT_MAX);
+    }
+
+    Deadline nextDeadline(const Connection& conn) const {
+        if (conn.lingering) return Deadline::Linger;
+        if (conn.h2) {
+            // Streams are independent, so there is no one request to time out.
+            if (!conn.out.empty()) return Deadline::Write;
+            if (conn.in_flight > 0) return Deadline::None;
+            for (const auto& [stream, body] : conn.h2_bodies) {
+                if (body.pulling) return Deadline::None;
+            }
+            if (conn.h2->activeStreams() > 0 || keep_alive_timeout <= 0) return Deadline::Body;
+            return Deadline::KeepAlive;
+        }
+        if (!conn.out.empty()) return conn.out.front().pulling ? Deadline::None : Deadline::Write;
+        if (conn.in_flight > 0) return handler_timeout > 0 ? Deadline::Handler : Deadline::None;
+        if (conn.head_size > 0 || conn.upload) return Deadline::Body;
+        if (!conn.in.empty() || conn.requests_served == 0) {
+            return header_timeout > 0 ? Deadline::Header : Deadline::None;
+        }
+        return Deadline::KeepAlive;
+    }
+
+    int timeoutSeconds(Deadline deadline) const {
+        switch (deadline) {
+            case Deadline::Header: return header_timeout;
+            case Deadline::Handler: return handler_timeout;
+            case Deadline::KeepAlive: return keep_alive_timeout;
+            case Deadline::Linger: return LINGER_TIMEOUT_SECONDS;
+            default: return IDLE_TIMEOUT_SECONDS;
+        }
+    }
+
+    // Called after every event on a connection. Header, handler and linger
+    // deadlines run from when that state began; the others are idle
+    // timeouts that start over on any activity.
+    void refreshTimer(EventLoop& loop, Connection& conn) {
+        Deadline deadline = nextDeadline(conn);
+        bool fixed = deadline == Deadline::Header || deadline == Deadline::Handler || deadline == Deadline::Linger;
+        if (deadline == conn.deadline && fixed && conn.armed()) return;
+
+        conn.deadline = deadline;
+        if (deadline == Deadline::None) {
+            loop.timers.cancel(conn);
+            return;
+        }
+        uint64_t ticks = ((uint64_t)timeoutSeconds(deadline) * 1000 + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+        loop.timers.schedule(conn, currentTick() + ticks);
+    }
+
+    void refreshTimer(EventLoop& loop, int fd, uint64_t id) {
+        Connection* conn = findConnection(loop, fd, id);
+        if (conn) refreshTimer(loop, *conn);
+    }
+
+    void expireTimers(EventLoop& loop) {
+        loop.timers.advance(currentTick(), [&](TimerNode& node) {
+            Connection& conn = static_cast<Connection&>(node);
+            int fd = conn.fd;
+            uint64_t id = conn.id;
+
+            if (conn.deadline == Deadline::Handler) {
+                // The handler keeps running; its response is dropped when it arrives.
+                conn.abandoned.insert(conn.write_seq);
+                conn.ready[conn.write_seq] = errorResponse(504);
+                conn.draining = true;
+                conn.in.reset();
+            } else if (conn.deadline == Deadline::Header && !conn.in.empty()) {
+                rejectRequest(conn, 408);
+            } else {
+                closeConnection(loop, conn);
+                return;
+            }
+
+            conn.deadline = Deadline::None;
+            if (queueReadyResponses(conn)) flushConnection(loop, conn);
+            refreshTimer(loop, fd, id);
+        });
+    }
+
+    static bool isSafeMethod(std::string_view buffer) {
+        return buffer.substr(0, 4) == "GET " || buffer.substr(0, 5) == "HEAD ";
+    }
+
+    bool dispatchRequests(EventLoop& loop, Connection& conn) {
+        if (conn.h2) return serviceHttp2(loop, conn);
+        if (http2 && conn.requests_served == 0 && !conn.in.empty() && conn.in.data()[0] == 'P') {
+            std::string_view input = conn.in.view();
+            size_t n = std::min(input.size(), H2_PREFACE.size());
+            if (input.substr(0, n) == H2_PREFACE.substr(0, n)) {
+                if (n < H2_PREFACE.size()) return true;
+                conn.h2 = std::make_unique<Http2Session>(max_body_size, MAX_HEADER_COUNT);
+                conn.h2->start();
+                return serviceHttp2(loop, conn);
+            }
+        }
+
+        while (!conn.draining
+               && conn.in_flight < PIPELINE_DEPTH
+               && conn.out_pending < PIPELINE_MAX_PENDING_OUTPUT
+               && (conn.in_flight == 0 || (!conn.barrier && isSafeMethod(conn.in.view())))) {
+            http_request req;
+            if (!extractRequest(conn, req)) break;
+
+            if (isOverloaded(loop)) {
+                shed_requests.fetch_add(1, std::memory_order_relaxed);
+                rejectRequest(conn, 503);
+                break;
+            }
+
+            if (http2 && conn.in_flight == 0 && conn.ready.empty() && upgradeHttp2(loop, conn, req)) {
+                return serviceHttp2(loop, conn);
+            }
+
+            conn.in_flight++;
+            conn.requests_served++;
+            if (req.method != "GET" && req.method != "HEAD") {
+                conn.barrier = true;
+            }
+
+            bool keep_alive = wantsKeepAlive(req)
+                && keep_alive_timeout > 0
+                && conn.requests_served < keep_alive_max_requests;
+            int remaining = keep_alive_max_requests - conn.requests_served;
+            if (!keep_alive) {
+                conn.draining = true;
+            }
+
+            EventLoop* target = &loop;
+            int fd = conn.fd;
+            uint64_t id = conn.id;
+            uint64_t seq = conn.next_seq++;
+            bool http10 = req.version == "HTTP/1.0";
+            bool head_only = req.method == "HEAD";
+
+            auto dispatch = [this, target, fd, id, seq, keep_alive, remaining, http10, head_only, req = std::move(req)]() mutable {
+                handleRequest(req, acceptedEncoding(req), [this, target, fd, id, seq, keep_alive, remaining, http10, head_only](http_response res) {
+                    // HTTP/1.0 has no chunked encoding, so a stream ends with the connection.
+                    bool chunked = res.stream && !http10;
+                    bool keep = keep_alive && !(res.stream && http10);
+                    string head = serializeHead(res, keep, remaining, chunked);
+                    string body;
+                    if (head_only) {
+                        // The head describes the body a GET would get, but none follows it.
+                        res.shared_body.reset();
+                        res.file.reset();
+                        res.stream.reset();
+                    } else {
+                        body = res.stream ? frameChunk(std::move(res.body), chunked, false) : std::move(res.body);
+                    }
+                    completeRequest(*target, fd, id, seq,
+                                    {keep, std::move(head), std::move(body), std::move(res.shared_body),
+                                     std::move(res.file), std::move(res.stream), chunked, {}});
+                });
+            };
+            static_assert(Task::fits_inline<decltype(dispatch)>, "request dispatch would allocate its Task");
+
+            try {
+                loop.pool.enqueue(std::move(dispatch));
+            } catch(const std::exception& e) {
+                cerr << "[ERROR] Failed to queue task: " << e.what() << endl;
+                closeConnection(loop, conn);
+                return false;
+            }
+        }
+
+        if (queueReadyResponses(conn) || !conn.out.empty()) {
+            return flushConnection(loop, conn);
+        }
+
+        if (conn.peer_closed && conn.in_flight == 0 && conn.out.empty()) {
+            closeConnection(loop, conn);
+            return false;
+        }
+        return true;
+    }
+
+    // "Upgrade: h2c" on a request without a body: answers 101 and carries on
+    // in HTTP/2 with the request as stream 1. False leaves it to HTTP/1.1.
+    bool upgradeHttp2(EventLoop& loop, Connection& conn, http_request& req) {
+        StrView length = req.headers.get(Header::ContentLength);
+        if (req.version != "HTTP/1.1" || !(length.empty() || length == "0")) return false;
+        if (!hasToken(req.headers.get(Header::Upgrade), "h2c")) return false;
+        if (!hasToken(req.headers.get(Header::Connection), "upgrade")) return false;
+        auto settings = req.headers.find("HTTP2-Settings");
+        if (settings == req.headers.end()) return false;
+
+        auto session = std::make_unique<Http2Session>(max_body_size, MAX_HEADER_COUNT);
+        if (!session->upgrade(settings->second)) return false;
+
+        queueOutput(conn, "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n");
+        conn.h2 = std::move(session);
+        conn.h2->start();
+        req.version = "HTTP/2.0";
+        dispatchHttp2(loop, conn, 1, std::move(req));
+        return true;
+    }
+
+    // Takes in whatever the client has sent, starts the requests it completes
+    // and writes out frames until the socket or flow control stops them.
+    bool serviceHttp2(EventLoop& loop, Connection& conn) {
+        Http2Session& h2 = *conn.h2;
+
+        // Requests are collected first: the session mustn't be re-entered from its own callback.
+        std::vector<std::pair<uint32_t, Http2Request>> requests;
+        size_t used = h2.receive(conn.in.view(), [&](uint32_t stream, Http2Request request) {
+            requests.emplace_back(stream, std::move(request));
+        });
+        conn.in.consume(used);
+        for (auto& [stream, request] : requests) {
+            startHttp2Request(loop, conn, stream, std::move(request));
+        }
+
+        while (true) {
+            pumpHttp2Bodies(loop, conn);
+            string frames;
+            h2.takeOutput(frames, H2_OUTPUT_BATCH);
+            if (frames.empty()) break;
+            queueOutput(conn, std::move(frames));
+            if (!writeOutput(loop, conn)) return false;
+            if (!conn.out.empty()) return true;
+        }
+
+        if (h2.finished()) {
+            conn.close_after_write = true;
+            return flushConnection(loop, conn);
+        }
+        if (conn.peer_closed && conn.in_flight == 0 && conn.h2_bodies.empty()) {
+            closeConnection(loop, conn);
+            return false;
+        }
+        return true;
+    }
+
+    void startHttp2Request(EventLoop& loop, Connection& conn, uint32_t stream, Http2Request request) {
+        if (request.error) {
+            respondHttp2(conn, stream, http2Response(errorPage(request.error)));
+            return;
+        }
+
+        http_request req;
+        if (!buildHttp2Request(conn, request, req)) {
+            respondHttp2(conn, stream, http2Response(errorPage(400)));
+            return;
+        }
+
+        string boundary;
+        if (!multipartBoundary(req, boundary)) {
+            respondHttp2(conn, stream, http2Response(errorPage(400)));
+            return;
+        }
+        if (req.method == "POST" && boundary.empty() && !req.body.empty()) {
+            parseForm(req.body, req.forms);
+        }
+        dispatchHttp2(loop, conn, stream, std::move(req));
+    }
+
+    // Lays the request out in one allocation, as extractRequest does, with
+    // the pseudo-headers in place of the request line. False if a singleton
+    // header is repeated with a different value.
+    bool buildHttp2Request(Connection& conn, const Http2Request& request, http_request& req) {
+        string cookies;
+        size_t total = request.body.size();
+        for (const auto& field : request.fields) {
+            if (field.name == "cookie") {
+                if (!cookies.empty()) cookies += "; ";
+                cookies += field.value;
+            } else {
+                total += field.name.size() + field.value.size();
+            }
+        }
+        total += cookies.size();
+
+        std::shared_ptr<char[]> storage(new char[total ? total : 1]);
+        char* cursor = storage.get();
+        auto copy = [&cursor](std::string_view text) {
+            memcpy(cursor, text.data(), text.size());
+            StrView view(cursor, text.size());
+            cursor += text.size();
+            return view;
+        };
+
+        for (const auto& field : request.fields) {
+            if (field.name == "cookie") continue;
+            StrView name = copy(field.name);
+            StrView value = copy(field.value);
+            if (name == ":method") {
+                req.method = value;
+            } else if (name == ":path") {
+                size_t query = value.find('?');
+                req.path = value.substr(0, query);
+                if (query != std::string_view::npos) req.query = value.substr(query + 1);
+            } else if (name == ":authority") {
+                if (!req.headers.add("host", value)) return false;
+            } else if (name[0] != ':') {
+                if (!req.headers.add(name, value)) return false;
+            }
+        }
+        if (!cookies.empty()) {
+            req.headers.add("cookie", copy(cookies));
+        }
+
+        req.body = copy(request.body);
+        req.raw = StrView(storage.get(), total);
+        req.version = "HTTP/2.0";
+        req.remote_addr = clientAddress(conn, req);
+        req.storage = std::move(storage);
+        return true;
+    }
+
+    void dispatchHttp2(EventLoop& loop, Connection& conn, uint32_t stream, http_request req) {
+        if (isOverloaded(loop)) {
+            shed_requests.fetch_add(1, std::memory_order_relaxed);
+            respondHttp2(conn, stream, http2Response(errorPage(503)));
+            return;
+        }
+
+        conn.in_flight++;
+        conn.requests_served++;
+
+        EventLoop* target = &loop;
+        int fd = conn.fd;
+        uint64_t id = conn.id;
+
+        auto dispatch = [this, target, fd, id, stream, req = std::move(req)]() mutable {
+            // The body arrived whole, so a multipart upload goes through the parser in one pass.
+            string boundary;
+            multipartBoundary(req, boundary);
+            if (!boundary.empty()) {
+                MultipartParser parser(boundary, upload_dir, max_body_size);
+                parser.feed(req.body.data(), req.body.size());
+                if (!parser.finish()) {
+                    completeRequest(*target, fd, id, stream, http2Response(errorPage(parser.error())));
+                    return;
+                }
+                req.forms.data = std::move(parser.fields);
+                req.forms.files = std::move(parser.files);
+            }
+
+            bool head = req.method == "HEAD";
+            handleRequest(req, acceptedEncoding(req), [this, target, fd, id, stream, head](http_response res) {
+                completeRequest(*target, fd, id, stream, http2Response(std::move(res), head));
+            });
+        };
+        static_assert(Task::fits_inline<decltype(dispatch)>, "request dispatch would allocate its Task");
+
+        try {
+            loop.pool.enqueue(std::move(dispatch));
+        } catch(const std::exception& e) {
+            cerr << "[ERROR] Failed to queue task: " << e.what() << endl;
+            conn.in_flight--;
+            respondHttp2(conn, stream, http2Response(errorPage(500)));
+        }
+    }
+
+    // The HTTP/2 form of a response: header fields instead of a head, and no
+    // body at all for HEAD.
+    PendingResponse http2Response(http_response res, bool head = false) {
+        PendingResponse response{true, "", "", nullptr, nullptr, nullptr, false, {}};
+        auto& fields = response.fields;
+        fields.emplace_back(":status", to_string(res.status));
+        fields.emplace_back("date", http_date());
+        fields.emplace_back("content-type", res.contentType + "; charset=utf-8");
+        if (!res.location.empty()) {
+            fields.emplace_back("location", res.location);
+        }
+        for (const auto& [key, value] : res.headers) {
+            string name = key;
+            transform(name.begin(), name.end(), name.begin(), ::tolower);
+            if (name == "connection" || name == "keep-alive" || name == "proxy-connection"
+                || name == "transfer-encoding" || name == "upgrade") {
+                continue;
+            }
+            fields.emplace_back(std::move(name), value);
+        }
+        if (!res.stream) {
+            fields.emplace_back("content-length", to_string(bodySize(res)));
+        }
+
+        if (!head) {
+            response.body = std::move(res.body);
+            response.shared_body = std::move(res.shared_body);
+            response.file = std::move(res.file);
+            response.stream = std::move(res.stream);
+        }
+        return response;
+    }
+
+    void respondHttp2(Connection& conn, uint32_t stream, PendingResponse response) {
+        Http2Session& h2 = *conn.h2;
+        if (!h2.isOpen(stream)) return;
+
+        bool pending = response.file || response.stream;
+        std::string_view body = response.shared_body ? std::string_view(*response.shared_body) : std::string_view(response.body);
+        h2.respond(stream, response.fields, body.empty() && !pending);
+        if (!body.empty()) {
+            h2.sendData(stream, body, !pending);
+        }
+        if (pending) {
+            Http2Body& body = conn.h2_bodies[stream];
+            body.file = std::move(response.file);
+            body.stream = std::move(response.stream);
+        }
+    }
+
+    // Tops up the streams whose bodies come from a file or a StreamBody,
+    // keeping about H2_BODY_CHUNK queued on each so memory stays bounded
+    // while flow control holds them back.
+    void pumpHttp2Bodies(EventLoop& loop, Connection& conn) {
+        Http2Session& h2 = *conn.h2;
+        for (auto it = conn.h2_bodies.begin(); it != conn.h2_bodies.end();) {
+            uint32_t stream = it->first;
+            Http2Body& body = it->second;
+            bool done = !h2.isOpen(stream);
+
+            if (!done && body.file) {
+                done = !readHttp2File(h2, stream, body);
+            } else if (!done && !body.pulling && h2.buffered(stream) < H2_BODY_CHUNK) {
+                body.pulling = true;
+                try {
+                    queueStreamPiece(loop, conn, body.stream, stream);
+                } catch(const std::exception& e) {
+                    cerr << "[ERROR] Failed to queue task: " << e.what() << endl;
+                    h2.cancel(stream, H2Error::Internal);
+                    done = true;
                 }
             }
+            it = done ? conn.h2_bodies.erase(it) : std::next(it);
+        }
+    }
+
+    // False once the whole file is queued on the stream, or it couldn't be read.
+    bool readHttp2File(Http2Session& h2, uint32_t stream, Http2Body& body) {
+        size_t size = body.file->size;
+        while (h2.buffered(stream) < H2_BODY_CHUNK) {
+            size_t n = std::min(H2_BODY_CHUNK, size - (size_t)body.offset);
+            string data(n, '\0');
+            ssize_t bytes_read = n > 0 ? pread(body.file->fd, data.data(), n, body.offset) : 0;
+            if (bytes_read < 0 && errno == EINTR) continue;
+            if (bytes_read < 0 || (n > 0 && bytes_read == 0)) {
+                cerr << "[ERROR] Failed to read response file" << endl;
+                h2.cancel(stream, H2Error::Internal);
+                return false;
+            }
+
+            data.resize(bytes_read);
+            body.offset += bytes_read;
+            bool last = (size_t)body.offset >= size;
+            h2.sendData(stream, data, last);
+            if (last) return false;
+        }
+        return true;
+    }
+
+    void receiveHttp2Piece(Connection& conn, StreamPiece& piece) {
+        auto it = conn.h2_bodies.find(piece.h2_stream);
+        if (it == conn.h2_bodies.end()) return;
+
+        it->second.pulling = false;
+        if (piece.failed) {
+            conn.h2->cancel(piece.h2_stream, H2Error::Internal);
         } else {
-            headers_part = full_request;
+            conn.h2->sendData(piece.h2_stream, piece.data, piece.last);
+        }
+        if (piece.failed || piece.last) {
+            conn.h2_bodies.erase(it);
+        }
+    }
+
+    void completeRequest(EventLoop& loop, int fd, uint64_t id, uint64_t seq, PendingResponse response) {
+        {
+            std::lock_guard<std::mutex> lock(loop.completed_mutex);
+            loop.completed.push_back({fd, id, seq, std::move(response)});
+        }
+        wakeLoop(loop);
+    }
+
+    bool pullStream(EventLoop& loop, Connection& conn, OutputChunk& chunk) {
+        chunk.pulling = true;
+        try {
+            queueStreamPiece(loop, conn, chunk.stream, 0);
+        } catch(const std::exception& e) {
+            cerr << "[ERROR] Failed to queue task: " << e.what() << endl;
+            closeConnection(loop, conn);
+            return false;
+        }
+        return true;
+    }
+
+    // Has a worker produce the next piece of `stream` and post it back to the loop.
+    void queueStreamPiece(EventLoop& loop, Connection& conn, std::shared_ptr<StreamBody> stream, uint32_t h2_stream) {
+        EventLoop* target = &loop;
+        int fd = conn.fd;
+        uint64_t id = conn.id;
+
+        loop.pool.enqueue([this, target, fd, id, stream, h2_stream]() {
+            StreamPiece piece{fd, id, ""};
+            piece.h2_stream = h2_stream;
+            try {
+                piece.last = !stream->next(piece.data);
+            } catch(const std::exception& e) {
+                cerr << "[ERROR] Stream exception: " << e.what() << endl;
+                piece.failed = true;
+            }
+            {
+                std::lock_guard<std::mutex> lock(target->completed_mutex);
+                target->streamed.push_back(std::move(piece));
+            }
+            wakeLoop(*target);
+        });
+    }
+
+    static string frameChunk(string data, bool chunked, bool last) {
+        if (!chunked) return data;
+
+        string framed;
+        if (!data.empty()) {
+            char size[20];
+            snprintf(size, sizeof(size), "%zx\r\n", data.size());
+            framed.reserve(data.size() + 32);
+            framed += size;
+            framed += data;
+            framed += "\r\n";
+        }
+        if (last) {
+            framed += "0\r\n\r\n";
+        }
+        return framed;
+    }
+
+    void wakeLoop(EventLoop& loop) {
+        uint64_t one = 1;
+        if (write(loop.wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            perror("[ERROR] eventfd write");
+        }
+    }
+
+    void drainCompletions(EventLoop& loop) {
+        uint64_t count;
+        while (read(loop.wake_fd, &count, sizeof(count)) > 0) {}
+
+        std::vector<Completion> ready;
+        std::vector<StreamPiece> pieces;
+        {
+            std::lock_guard<std::mutex> lock(loop.completed_mutex);
+            ready.swap(loop.completed);
+            pieces.swap(loop.streamed);
         }
 
-        istringstream header_stream(headers_part);
-        string line;
-        bool first_line = true;
-        while (getline(header_stream, line)) {
-            if (first_line) {
-                first_line = false;
+        for (auto& piece : pieces) {
+            auto it = loop.connections.find(piece.fd);
+            if (it == loop.connections.end() || it->second->id != piece.id) continue;
+
+            Connection& conn = *it->second;
+            if (conn.h2) {
+                receiveHttp2Piece(conn, piece);
+                flushConnection(loop, conn);
+                refreshTimer(loop, piece.fd, piece.id);
                 continue;
             }
-            
-            size_t colon = line.find(": ");
-            if (colon != string::npos) {
-                string key = line.substr(0, colon);
-                string value = line.substr(colon + 2);
-                if (!value.empty() && value.back() == '\r') {
-                    value.pop_back();
+            if (piece.failed) {
+                // The head is already out, so a broken stream can only be cut short.
+                closeConnection(loop, conn);
+                continue;
+            }
+            if (conn.out.empty() || !conn.out.front().pulling) continue;
+
+            OutputChunk& chunk = conn.out.front();
+            chunk.pulling = false;
+            chunk.head.clear();
+            chunk.body = frameChunk(std::move(piece.data), chunk.chunked, piece.last);
+            chunk.offset = 0;
+            if (piece.last) {
+                chunk.stream.reset();
+            }
+            conn.out_pending += chunk.body.size();
+            flushConnection(loop, conn);
+            refreshTimer(loop, piece.fd, piece.id);
+        }
+
+        std::vector<int> touched;
+        for (auto& done : ready) {
+            auto it = loop.connections.find(done.fd);
+            if (it == loop.connections.end() || it->second->id != done.id) continue;
+
+            Connection& conn = *it->second;
+            conn.in_flight--;
+            if (conn.h2) {
+                respondHttp2(conn, (uint32_t)done.seq, std::move(done.response));
+                touched.push_back(done.fd);
+                continue;
+            }
+            if (conn.in_flight == 0) {
+                conn.barrier = false;
+            }
+            touched.push_back(done.fd);
+            // Already answered with a 504, which may have been written.
+            if (conn.abandoned.erase(done.seq)) continue;
+            conn.ready[done.seq] = std::move(done.response);
+        }
+
+        for (int fd : touched) {
+            auto it = loop.connections.find(fd);
+            if (it == loop.connections.end()) continue;
+
+            Connection& conn = *it->second;
+            uint64_t id = conn.id;
+            // The next request in the pipeline gets a full handler timeout.
+            conn.deadline = Deadline::None;
+            if (conn.h2 || queueReadyResponses(conn)) {
+                flushConnection(loop, conn);
+            }
+            refreshTimer(loop, fd, id);
+        }
+    }
+
+    bool queueReadyResponses(Connection& conn) {
+        if (conn.close_after_write || conn.ready.empty() || conn.ready.begin()->first != conn.write_seq) {
+            return false;
+        }
+
+        while (!conn.ready.empty() && conn.ready.begin()->first == conn.write_seq) {
+            PendingResponse& next = conn.ready.begin()->second;
+            queueOutput(conn, std::move(next.head), std::move(next.body), std::move(next.shared_body),
+                        std::move(next.file), std::move(next.stream), next.chunked);
+            bool keep_alive = next.keep_alive;
+            conn.ready.erase(conn.ready.begin());
+            conn.write_seq++;
+            if (!keep_alive) {
+                conn.close_after_write = true;
+                conn.draining = true;
+                break;
+            }
+        }
+        return true;
+    }
+
+    http_response errorPage(int status) {
+        http_response res("<h1>" + string(status_reason(status)) + "</h1>");
+        res.status = status;
+        if (status == 503) {
+            res.headers["Retry-After"] = to_string(retry_after);
+        }
+        return res;
+    }
+
+    PendingResponse errorResponse(int status) {
+        http_response res = errorPage(status);
+        string head = serializeHead(res, false, 0);
+        return {false, std::move(head), std::move(res.body), nullptr, nullptr, nullptr, false, {}};
+    }
+
+    void rejectRequest(Connection& conn, int status) {
+        conn.ready[conn.next_seq++] = errorResponse(status);
+        conn.draining = true;
+        conn.in.reset();
+    }
+
+    // Requests from the proxy on the Unix socket carry the client's address
+    // in X-Real-IP, or as the last hop of X-Forwarded-For, which is the one
+    // the proxy appended itself.
+    string clientAddress(const Connection& conn, const http_request& req) {
+        if (!conn.proxied) return conn.remote_addr;
+
+        std::string_view address = trimSpace(req.headers.get(Header::XRealIp));
+        if (address.empty()) {
+            std::string_view forwarded = req.headers.get(Header::XForwardedFor);
+            size_t comma = forwarded.rfind(',');
+            address = trimSpace(comma == std::string_view::npos ? forwarded : forwarded.substr(comma + 1));
+        }
+        return address.empty() ? conn.remote_addr : string(address);
+    }
+
+    static bool hasToken(std::string_view value, std::string_view token) {
+        auto it = std::search(value.begin(), value.end(), token.begin(), token.end(), [](char a, char b) {
+            return tolower((unsigned char)a) == tolower((unsigned char)b);
+        });
+        return it != value.end();
+    }
+
+    bool wantsKeepAlive(const http_request& req) {
+        auto it = req.headers.find(Header::Connection);
+        if (req.version == "HTTP/1.0") {
+            return it != req.headers.end() && hasToken(it->second, "keep-alive");
+        }
+        return it == req.headers.end() || !hasToken(it->second, "close");
+    }
+
+    bool extractRequest(Connection& conn, http_request& req) {
+        if (conn.upload) {
+            return extractUpload(conn, req);
+        }
+
+        std::string_view buffer = conn.in.view();
+        bool whole_storage = false;
+
+        if (conn.head_size == 0) {
+            size_t header_end = buffer.find("\r\n\r\n", conn.scan_offset);
+            if (header_end == std::string_view::npos) {
+                if (buffer.size() > MAX_HEADER_SIZE) {
+                    rejectRequest(conn, 431);
+                } else {
+                    conn.scan_offset = buffer.size() > 3 ? buffer.size() - 3 : 0;
+                }
+                return false;
+            }
+
+            conn.pending = http_request();
+            if (int status = parseHead(buffer.substr(0, header_end), conn.pending)) {
+                rejectRequest(conn, status);
+                return false;
+            }
+            conn.head_size = header_end + 4;
+            conn.content_length = 0;
+
+            // Bodies are framed by Content-Length alone. One sent with a
+            // Transfer-Encoding would otherwise be read as further requests.
+            if (conn.pending.headers.count(Header::TransferEncoding)) {
+                rejectRequest(conn, conn.pending.headers.count(Header::ContentLength) ? 400 : 501);
+                return false;
+            }
+
+            auto it = conn.pending.headers.find(Header::ContentLength);
+            if (it != conn.pending.headers.end()) {
+                std::string_view value = it->second;
+                const char* value_end = value.data() + value.size();
+                auto [ptr, ec] = std::from_chars(value.data(), value_end, conn.content_length);
+                if (value.empty() || ec != std::errc() || ptr != value_end) {
+                    rejectRequest(conn, 400);
+                    return false;
+                }
+            }
+
+            string boundary;
+            if (!multipartBoundary(conn.pending, boundary)) {
+                rejectRequest(conn, 400);
+                return false;
+            }
+
+            if (conn.content_length > (boundary.empty() ? max_body_size : max_upload_size)) {
+                rejectRequest(conn, 413);
+                return false;
+            }
+
+            // The views parsed above point into the connection buffer, which is
+            // reused once the request is handed off. Copy the request into one
+            // allocation it owns and point the views there instead. Until the
+            // body is all here that holds just the head, so a Content-Length
+            // the client never backs with bytes doesn't pin memory.
+            size_t total = conn.head_size + conn.content_length;
+            whole_storage = boundary.empty() && buffer.size() >= total;
+            conn.pending_storage.reset(new char[whole_storage ? total : conn.head_size]);
+            memcpy(conn.pending_storage.get(), buffer.data(), conn.head_size);
+            rebaseHead(conn.pending, buffer.data(), conn.pending_storage.get());
+
+            if (buffer.size() < total) {
+                auto expect = conn.pending.headers.find(Header::Expect);
+                if (expect != conn.pending.headers.end() && hasToken(expect->second, "100-continue")
+                    && conn.in_flight == 0 && conn.ready.empty()) {
+                    queueOutput(conn, "HTTP/1.1 100 Continue\r\n\r\n");
                 }
-                req.headers[key] = value;
             }
+
+            if (!boundary.empty()) {
+                // Multipart bodies are parsed as they arrive instead of being buffered whole.
+                conn.pending.raw = StrView(conn.pending_storage.get(), conn.head_size);
+                conn.pending.storage = std::move(conn.pending_storage);
+                conn.upload = std::make_unique<MultipartParser>(boundary, upload_dir, max_body_size);
+                conn.upload_remaining = conn.content_length;
+                conn.in.consume(conn.head_size);
+                return extractUpload(conn, req);
+            }
+
+            if (buffer.size() < total) {
+                // Past this the buffer grows as the body arrives.
+                conn.in.reserve(std::min(total, BODY_PREALLOC));
+                buffer = conn.in.view();
+            }
+        }
+
+        size_t total = conn.head_size + conn.content_length;
+        if (buffer.size() < total) {
+            return false;
+        }
+
+        if (!whole_storage) {
+            std::shared_ptr<char[]> storage(new char[total]);
+            memcpy(storage.get(), conn.pending_storage.get(), conn.head_size);
+            rebaseHead(conn.pending, conn.pending_storage.get(), storage.get());
+            conn.pending_storage = std::move(storage);
         }
 
+        char* storage = conn.pending_storage.get();
+        memcpy(storage + conn.head_size, buffer.data() + conn.head_size, conn.content_length);
+
+        req = std::move(conn.pending);
+        req.raw = StrView(storage, total);
+        req.body = StrView(storage + conn.head_size, conn.content_length);
+        req.storage = std::move(conn.pending_storage);
+        req.remote_addr = clientAddress(conn, req);
+
+        conn.in.consume(total);
+        conn.scan_offset = 0;
+        conn.head_size = 0;
+        conn.content_length = 0;
+
         if (req.method == "POST" && !req.body.empty()) {
-            string form_data = req.body;
-            size_t pair_start = 0;
+            parseForm(req.body, req.forms);
+        }
+        return true;
+    }
+
+    bool extractUpload(Connection& conn, http_request& req) {
+        size_t take = std::min(conn.in.size(), conn.upload_remaining);
+        if (take > 0) {
+            conn.upload->feed(conn.in.data(), take);
+            conn.in.consume(take);
+            conn.upload_remaining -= take;
+        }
+
+        if (conn.upload_remaining > 0 && conn.upload->error() == 0) {
+            return false;
+        }
+
+        if (!conn.upload->finish()) {
+            int status = conn.upload->error();
+            conn.upload.reset();
+            rejectRequest(conn, status);
+            return false;
+        }
+
+        req = std::move(conn.pending);
+        req.remote_addr = clientAddress(conn, req);
+        req.forms.data = std::move(conn.upload->fields);
+        req.forms.files = std::move(conn.upload->files);
+
+        conn.upload.reset();
+        conn.scan_offset = 0;
+        conn.head_size = 0;
+        conn.content_length = 0;
+        return true;
+    }
+
+    // Leaves `boundary` empty for anything but multipart/form-data; false if
+    // the boundary is missing or malformed.
+    static bool multipartBoundary(const http_request& req, string& boundary) {
+        auto it = req.headers.find(Header::ContentType);
+        if (it == req.headers.end()) return true;
+
+        string type = it->second;
+        transform(type.begin(), type.end(), type.begin(), ::tolower);
+        if (type.compare(0, 19, "multipart/form-data") != 0) return true;
+
+        size_t pos = type.find("boundary=");
+        if (pos == string::npos) return false;
+
+        boundary = it->second.substr(pos + 9);
+        size_t end = boundary.find(';');
+        if (end != string::npos) boundary.resize(end);
+        while (!boundary.empty() && isspace((unsigned char)boundary.back())) boundary.pop_back();
+        if (boundary.size() >= 2 && boundary.front() == '"' && boundary.back() == '"') {
+            boundary = boundary.substr(1, boundary.size() - 2);
+        }
+        return !boundary.empty() && boundary.size() <= 70;
+    }
+
+    static std::string_view trimSpace(std::string_view value) {
+        while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) value.remove_prefix(1);
+        while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) value.remove_suffix(1);
+        return value;
+    }
+
+    static std::string_view nextToken(std::string_view& line) {
+        size_t start = line.find_first_not_of(' ');
+        if (start == std::string_view::npos) {
+            line = std::string_view();
+            return line;
+        }
+        size_t end = line.find(' ', start);
+        if (end == std::string_view::npos) end = line.size();
+        std::string_view token = line.substr(start, end - start);
+        line.remove_prefix(end);
+        return token;
+    }
+
+    // False if the request carries more than MAX_HEADER_COUNT headers.
+    // 0, or the status to reject the request with.
+    int parseHead(std::string_view head, http_request& req) {
+        size_t pos = head.find('\n');
+        std::string_view line = head.substr(0, pos);
+        if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+
+        req.method = nextToken(line);
+        StrView target = nextToken(line);
+        req.version = nextToken(line);
+
+        size_t query = target.find('?');
+        req.path = target.substr(0, query);
+        if (query != std::string_view::npos) {
+            req.query = target.substr(query + 1);
+        }
+
+        size_t lines = 0;
+        while (pos < head.size()) {
+            size_t start = pos + 1;
+            pos = head.find('\n', start);
+            if (pos == std::string_view::npos) pos = head.size();
+            std::string_view header = head.substr(start, pos - start);
+            if (!header.empty() && header.back() == '\r') header.remove_suffix(1);
+
+            size_t colon = header.find(':');
+            if (colon != std::string_view::npos) {
+                if (++lines > MAX_HEADER_COUNT) return 431;
+                if (!req.headers.add(header.substr(0, colon), trimSpace(header.substr(colon + 1)))) return 400;
+            }
+        }
+        return 0;
+    }
+
+    static void rebaseHead(http_request& req, const char* from, const char* to) {
+        for (StrView* view : {&req.method, &req.path, &req.query, &req.version}) {
+            if (!view->empty()) *view = StrView(to + (view->data() - from), view->size());
+        }
+        req.headers.rebase(from, to);
+    }
+
+    void parseForm(std::string_view form_data, FormData& forms) {
+        size_t pair_start = 0;
+        
+        while (pair_start < form_data.length()) {
+            size_t pair_end = form_data.find('&', pair_start);
+            if (pair_end == std::string_view::npos) {
+                pair_end = form_data.length();
+            }
             
-            while (pair_start < form_data.length()) {
-                size_t pair_end = form_data.find('&', pair_start);
-                if (pair_end == string::npos) {
-                    pair_end = form_data.length();
-                }
-                
-                string pair = form_data.substr(pair_start, pair_end - pair_start);
-                size_t eq_pos = pair.find('=');
+            std::string_view pair = form_data.substr(pair_start, pair_end - pair_start);
+            size_t eq_pos = pair.find('=');
+            
+            if (eq_pos != std::string_view::npos) {
+                string key = url_decode(pair.substr(0, eq_pos));
+                string value = url_decode(pair.substr(eq_pos + 1));
                 
-                if (eq_pos != string::npos) {
-                    string key = url_decode(pair.substr(0, eq_pos));
-                    string value = url_decode(pair.substr(eq_pos + 1));
-                    
-                    size_t last_char = value.find_last_not_of(" \t\r\n\0");
-                    if (last_char != string::npos) {
-                        value = value.substr(0, last_char + 1);
-                    } else {
-                        value = "";
-                    }
-                    
-                    req.forms.data[key] = value;
+                size_t last_char = value.find_last_not_of(" \t\r\n\0");
+                if (last_char != string::npos) {
+                    value.resize(last_char + 1);
+                } else {
+                    value.clear();
                 }
                 
-                pair_start = pair_end + 1;
+                forms.data[key] = std::move(value);
+            }
+            
+            pair_start = pair_end + 1;
+        }
+    }
+
+    const Route* matchRoute(http_request& req) {
+        std::vector<Route>* routes = nullptr;
+        if (req.method == "GET" || req.method == "HEAD") routes = &routesGET;
+        if (req.method == "POST") routes = &routesPOST;
+        if (!routes) return nullptr;
+
+        for (const auto& route : *routes) {
+            if (route.pattern.matches(req.path, req.params)) {
+                return &route;
+            }
+        }
+        return nullptr;
+    }
+
+    void finishRequest(const http_request& req, const http_response& res, const Route* route,
+                       std::chrono::steady_clock::time_point started) {
+        uint64_t micros = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - started).count();
+
+        if (metrics_enabled) {
+            RouteMetrics* metrics = route ? route->metrics.get() : unmatched_metrics.get();
+            metrics->latency.record(micros);
+            metrics->responses[std::clamp(res.status / 100, 1, 5) - 1].add();
+        }
+        logRequest(req, res, micros);
+    }
+
+    void logRequest(const http_request& req, const http_response& res, uint64_t micros) {
+        if (!access_log.enabled()) return;
+
+        AccessLogEntry entry;
+        entry.remote_addr = req.remote_addr;
+        entry.method = req.method;
+        entry.path = req.path;
+        entry.query = req.query;
+        entry.version = req.version;
+        entry.referer = req.headers.get(Header::Referer);
+        entry.user_agent = req.headers.get(Header::UserAgent);
+        entry.status = res.status;
+        if (!res.stream) {
+            entry.bytes = (int64_t)bodySize(res);
+        }
+        entry.duration_us = micros;
+        access_log.log(entry);
+    }
+
+    string renderMetrics() {
+        MetricsText text;
+
+        auto routeLabels = [](const char* method, const Route& route) {
+            return MetricsText::label("method", method) + "," + MetricsText::label("route", route.pattern.pattern);
+        };
+        auto eachRoute = [&](auto f) {
+            for (const auto& route : routesGET) f("GET", route);
+            for (const auto& route : routesPOST) f("POST", route);
+        };
+
+        text.family("six_http_responses_total", "counter", "Responses by route and status class.");
+        auto responses = [&](const string& labels, const RouteMetrics& metrics) {
+            for (int i = 0; i < 5; ++i) {
+                if (metrics.responses[i].value() == 0) continue;
+                string code = MetricsText::label("code", to_string(i + 1) + "xx");
+                text.sample("six_http_responses_total", labels + "," + code, (double)metrics.responses[i].value());
             }
+        };
+        eachRoute([&](const char* method, const Route& route) {
+            if (route.metrics) responses(routeLabels(method, route), *route.metrics);
+        });
+        responses(MetricsText::label("method", "") + "," + MetricsText::label("route", ""), *unmatched_metrics);
+
+        text.family("six_http_request_duration_seconds", "histogram", "Time spent handling requests, by route.");
+        eachRoute([&](const char* method, const Route& route) {
+            if (route.metrics) text.histogram("six_http_request_duration_seconds", routeLabels(method, route), route.metrics->latency);
+        });
+        text.histogram("six_http_request_duration_seconds",
+                       MetricsText::label("method", "") + "," + MetricsText::label("route", ""), unmatched_metrics->latency);
+
+        text.family("six_sql_duration_seconds", "histogram", "Time spent in SQLite calls, by operation.");
+        for (size_t i = 0; i < (size_t)SqlOp::Count; ++i) {
+            text.histogram("six_sql_duration_seconds", MetricsText::label("op", SQL_OP_NAMES[i]), sql_histogram((SqlOp)i));
+        }
+
+        text.family("six_worker_queue_depth", "gauge", "Requests waiting for a worker thread.");
+        for (size_t i = 0; i < loops.size(); ++i) {
+            text.sample("six_worker_queue_depth", MetricsText::label("shard", to_string(i)), (double)loops[i]->pool.pending_tasks());
+        }
+        text.family("six_open_connections", "gauge", "Open client connections.");
+        for (size_t i = 0; i < loops.size(); ++i) {
+            text.sample("six_open_connections", MetricsText::label("shard", to_string(i)),
+                        (double)loops[i]->open_connections.load(std::memory_order_relaxed));
+        }
+        text.family("six_received_bytes_total", "counter", "Bytes read from clients.");
+        for (size_t i = 0; i < loops.size(); ++i) {
+            text.sample("six_received_bytes_total", MetricsText::label("shard", to_string(i)),
+                        (double)loops[i]->bytes_in.load(std::memory_order_relaxed));
         }
+        text.family("six_sent_bytes_total", "counter", "Bytes written to clients.");
+        for (size_t i = 0; i < loops.size(); ++i) {
+            text.sample("six_sent_bytes_total", MetricsText::label("shard", to_string(i)),
+                        (double)loops[i]->bytes_out.load(std::memory_order_relaxed));
+        }
+
+        text.family("six_shed_connections_total", "counter", "Connections turned away by load shedding.");
+        text.sample("six_shed_connections_total", "", (double)shedConnections());
+        text.family("six_shed_requests_total", "counter", "Requests turned away by load shedding.");
+        text.sample("six_shed_requests_total", "", (double)shedRequests());
+        text.family("six_access_log_dropped_total", "counter", "Access log lines dropped because the writer fell behind.");
+        text.sample("six_access_log_dropped_total", "", (double)accessLogDropped());
+
+        if (tls) {
+            uint64_t resumed = tls_resumed.load(std::memory_order_relaxed);
+            uint64_t full = tls_handshakes.load(std::memory_order_relaxed) - resumed;
+            text.family("six_tls_handshakes_total", "counter", "Completed TLS handshakes, by whether the session was resumed.");
+            text.sample("six_tls_handshakes_total", MetricsText::label("resumed", "false"), (double)full);
+            text.sample("six_tls_handshakes_total", MetricsText::label("resumed", "true"), (double)resumed);
+            text.family("six_tls_kernel_connections_total", "counter", "TLS connections whose writes were handed to kernel TLS.");
+            text.sample("six_tls_kernel_connections_total", "", (double)tls_kernel.load(std::memory_order_relaxed));
+        }
+
+        if (std::any_of(routesGET.begin(), routesGET.end(), [](const Route& route) { return route.cache; })) {
+            text.family("six_response_cache_hits_total", "counter", "Requests answered from the response cache.");
+            text.sample("six_response_cache_hits_total", "", (double)response_cache.hitCount());
+            text.family("six_response_cache_misses_total", "counter", "Requests to cached routes that ran the handler.");
+            text.sample("six_response_cache_misses_total", "", (double)response_cache.missCount());
+            text.family("six_response_cache_bytes", "gauge", "Memory held by cached responses.");
+            text.sample("six_response_cache_bytes", "", (double)response_cache.size());
+        }
+
+        return std::move(text.str());
+    }
 
+    // Passes the route's response, compressed for `encoding`, to `done`.
+    template <typename Done>
+    void handleRequest(http_request& req, Encoding encoding, Done done) {
+        auto started = std::chrono::steady_clock::now();
         http_response res;
-        int status_code = 404;
+        Arena& arena = thread_arena();
         
         g_current_response = &res;
         g_current_request = &req;
+        current_arena() = &arena;
         
         extern void load_current_user();
-        load_current_user();
-        
-        if (req.method == "GET") {
-            for (auto& [pattern, handler] : routesGET) {
-                if (pattern.matches(req.path, req.params)) {
-                    res = handler(req);
-                    status_code = res.status;
-                    goto send_response;
-                }
+        extern void six_sql_clear_pending();
+
+        const Route* route = nullptr;
+        string cache_key;
+        std::shared_ptr<const CachedResponse> cached;
+        try {
+            route = matchRoute(req);
+
+            if (route && route->cache) {
+                cache_key = cacheKey(req, *route->cache, encoding);
+                cached = response_cache.get(cache_key);
             }
-        }
-        
-        if (req.method == "POST") {
-            for (auto& [pattern, handler] : routesPOST) {
-                if (pattern.matches(req.path, req.params)) {
-                    res = handler(req);
-                    status_code = res.status;
-                    goto send_response;
-                }
+
+            // A hit skips the session lookup along with the handler.
+            if (!cached) load_current_user();
+
+            if (route && route->deferred) {
+                // The worker's arena is reset before the coroutine finishes, so it gets its own.
+                auto owned = std::make_shared<http_request>(std::move(req));
+                auto owned_arena = std::make_shared<Arena>();
+                g_current_request = owned.get();
+                current_arena() = owned_arena.get();
+
+                route->deferred(*owned, [this, owned, owned_arena, route, started, encoding, done](http_response res) mutable {
+                    Arena* previous = std::exchange(current_arena(), owned_arena.get());
+                    finishRequest(*owned, res, route, started);
+                    compressResponse(res, encoding);
+                    done(std::move(res));
+                    current_arena() = previous;
+                });
+
+                g_current_response = nullptr;
+                g_current_request = nullptr;
+                current_arena() = nullptr;
+                arena.reset();
+                six_sql_clear_pending();
+                return;
             }
-        }
-        
-        if (fallback) {
-            res = fallback(req);
-            status_code = res.status;
-        } else {
-            res.status = 404;
-            string template_content = loadFile("./six/six_templates/404.html");
-            if (template_content.empty()) {
-                res.body = "<h1>404 Not Found</h1>";
+
+            if (cached) {
+                res = cachedResponse(*cached);
+            } else if (route) {
+                res = route->handler(req);
+            } else if (fallback) {
+                res = fallback(req);
             } else {
-                res.body = template_content;
+                res.status = 404;
+                string template_content = loadFile("./six/six_templates/404.html");
+                if (template_content.empty()) {
+                    res.body = "<h1>404 Not Found</h1>";
+                } else {
+                    res.body = template_content;
+                }
             }
-            status_code = 404;
+        } catch(const std::exception& e) {
+            cerr << "[ERROR] Handler exception: " << e.what() << endl;
+            res = http_response("<h1>" + string(status_reason(500)) + "</h1>");
+            res.status = 500;
         }
 
-        send_response:
         g_current_response = nullptr;
         g_current_request = nullptr;
         
-        extern void six_sql_clear_pending();
         six_sql_clear_pending();
 
-        cout << req.remote_addr << " - - [" << getCurrentTime() << "] \"" << req.method << " " << req.path << " HTTP/1.1\" " << status_code << "\n";
+        finishRequest(req, res, route, started);
+        if (!cached) {
+            bool store = !cache_key.empty() && cacheable(res);
+            compressResponse(res, encoding);
+            if (store) storeResponse(cache_key, res, route->cache->ttl);
+        }
+        done(std::move(res));
+
+        current_arena() = nullptr;
+        arena.reset();
+    }
+
+    static string cacheKey(const http_request& req, const cache_policy& policy, Encoding encoding) {
+        string key;
+        // HEAD shares the GET entry; only the body is left off when it is sent.
+        key += req.method == "HEAD" ? std::string_view("GET") : std::string_view(req.method);
+        key += ' ';
+        key += req.path;
+        key += '?';
+        key += req.query;
+        key += '\0';
+        key += encoding_name(encoding);
+        if (policy.vary_on_cookie) {
+            key += '\0';
+            key += req.headers.get(Header::Cookie);
+        }
+        for (const auto& name : policy.vary_headers) {
+            key += '\0';
+            key += req.headers.get(name);
+        }
+        return key;
+    }
+
+    // Checked before compression, so a file that compressFile() turns into a
+    // body isn't cached twice.
+    static bool cacheable(const http_response& res) {
+        if (res.status != 200 || res.stream || res.file || res.headers.count("Set-Cookie")) return false;
+        auto it = res.headers.find("Cache-Control");
+        return it == res.headers.end()
+            || (it->second.find("private") == string::npos && it->second.find("no-store") == string::npos);
+    }
+
+    // The body moves into the entry and `res` sends it from there.
+    void storeResponse(const string& key, http_response& res, int ttl) {
+        if (!res.shared_body) {
+            res.shared_body = std::make_shared<const string>(std::move(res.body));
+            res.body.clear();
+        }
+        auto entry = std::make_shared<CachedResponse>();
+        entry->status = res.status;
+        entry->content_type = res.contentType;
+        entry->location = res.location;
+        entry->headers = res.headers;
+        entry->body = res.shared_body;
+        response_cache.put(key, std::move(entry), ttl);
+    }
+
+    static http_response cachedResponse(const CachedResponse& entry) {
+        http_response res;
+        res.shared_body = entry.body;
+        res.status = entry.status;
+        res.contentType = entry.content_type;
+        res.location = entry.location;
+        res.headers = entry.headers;
+        return res;
+    }
+
+    Encoding acceptedEncoding(const http_request& req) {
+        if (!compression) return Encoding::Identity;
+        auto it = req.headers.find(Header::AcceptEncoding);
+        if (it == req.headers.end()) return Encoding::Identity;
+        return negotiate_encoding(it->second);
+    }
+
+    size_t compressionThreshold(const string& content_type) {
+        size_t threshold = SIZE_MAX;
+        size_t matched = 0;
+        for (const auto& [type, min_bytes] : compression_thresholds) {
+            if (type.size() > matched && content_type.compare(0, type.size(), type) == 0) {
+                threshold = min_bytes;
+                matched = type.size();
+            }
+        }
+        return threshold;
+    }
+
+    int compressionLevel() {
+        // Trade ratio for throughput while requests are queueing for a worker.
+        ThreadPool* pool = ThreadPool::current();
+        if (pool && pool->pending_tasks() >= pool->size()) return 1;
+        return compression_level;
+    }
+
+    void compressResponse(http_response& res, Encoding encoding) {
+        if (!compression || res.stream || res.shared_body || res.status == 204 || res.status == 304
+            || res.headers.count("Content-Encoding")) {
+            return;
+        }
+
+        size_t size = res.file ? res.file->size : res.body.size();
+        if (size < compressionThreshold(res.contentType)) return;
+
+        res.headers["Vary"] = "Accept-Encoding";
+        if (encoding == Encoding::Identity) return;
+
+        if (res.file) {
+            compressFile(res, encoding);
+            return;
+        }
+
+        string compressed;
+        if (compress_body(res.body, compressed, encoding, compressionLevel()) && compressed.size() < res.body.size()) {
+            res.body = std::move(compressed);
+            res.headers["Content-Encoding"] = encoding_name(encoding);
+        }
+    }
+
+    void compressFile(http_response& res, Encoding encoding) {
+        const FileBody& file = *res.file;
+        if (file.path.empty()) return;
+
+        if (encoding == Encoding::Gzip) {
+            int fd = open((file.path + ".gz").c_str(), O_RDONLY | O_CLOEXEC);
+            struct stat st{};
+            if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_mtime >= file.mtime) {
+                res.file = std::make_shared<FileBody>(fd, (size_t)st.st_size);
+                res.headers["Content-Encoding"] = "gzip";
+                return;
+            }
+            if (fd >= 0) close(fd);
+        }
+
+        if (file.size > MAX_CACHED_FILE_SIZE) return;
+
+        auto cached = compressed_cache.get(file.path, encoding, file.size, file.mtime);
+        if (!cached) {
+            char* content = static_cast<char*>(request_arena().allocate(file.size, 1));
+            size_t done = 0;
+            while (done < file.size) {
+                ssize_t n = pread(file.fd, content + done, file.size - done, done);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) return;
+                done += n;
+            }
+
+            auto compressed = std::make_shared<string>();
+            if (!compress_body(std::string_view(content, file.size), *compressed, encoding, CACHED_COMPRESSION_LEVEL)) return;
+            compressed_cache.put(file.path, encoding, file.size, file.mtime, compressed);
+            cached = compressed;
+        }
+
+        if (cached->size() >= file.size) return;
+        res.shared_body = std::move(cached);
+        res.file.reset();
+        res.headers["Content-Encoding"] = encoding_name(encoding);
+    }
+
+    static size_t bodySize(const http_response& res) {
+        if (res.file) return res.file->size;
+        return res.shared_body ? res.shared_body->size() : res.body.size();
+    }
+
+    string serializeHead(const http_response& res, bool keep_alive, int remaining, bool chunked = false) {
+        // The fixed text, status line and numbers fit in 256 bytes, so the
+        // head is built in a single allocation and returned without a copy.
+        size_t size = 256 + res.contentType.size() + res.location.size();
+        for (const auto& [key, value] : res.headers) size += key.size() + value.size() + 4;
+        string buffer;
+        buffer.reserve(size);
 
-        ostringstream response;
-        response << "HTTP/1.1 " << res.status << " OK\r\n";
-        response << "Content-Type: " << res.contentType << "; charset=utf-8\r\n";
+        buffer += "HTTP/1.1 ";
+        buffer += to_string(res.status);
+        buffer += ' ';
+        buffer += status_reason(res.status);
+        buffer += "\r\nDate: ";
+        buffer += http_date();
+        buffer += "\r\nContent-Type: ";
+        buffer += res.contentType;
+        buffer += "; charset=utf-8\r\n";
         if (!res.location.empty()) {
-            response << "Location: " << res.location << "\r\n";
+            buffer += "Location: ";
+            buffer += res.location;
+            buffer += "\r\n";
         }
         for (const auto& [key, value] : res.headers) {
-            response << key << ": " << value << "\r\n";
+            buffer += key;
+            buffer += ": ";
+            buffer += value;
+            buffer += "\r\n";
         }
-        response << "Content-Length: " << res.body.length() << "\r\n";
-        response << "Connection: close\r\n";
-        response << "\r\n";
-        response << res.body;
-
-        string response_str = response.str();
-        ssize_t bytes_written = write(client_fd, response_str.c_str(), response_str.length());
-        if (bytes_written < 0) {
-            cerr << "[ERROR] Failed to write response" << endl;
+        if (chunked) {
+            buffer += "Transfer-Encoding: chunked\r\n";
+        } else if (!res.stream) {
+            buffer += "Content-Length: ";
+            buffer += to_string(bodySize(res));
+            buffer += "\r\n";
+        }
+        if (keep_alive) {
+            buffer += "Connection: keep-alive\r\nKeep-Alive: timeout=";
+            buffer += to_string(keep_alive_timeout);
+            buffer += ", max=";
+            buffer += to_string(remaining);
+        } else {
+            buffer += "Connection: close";
         }
+        buffer += "\r\n\r\n";
+
+        return buffer;
     }
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -5,6 +5,10 @@
 #include <fstream>
 #include <sstream>
 #include <filesystem>
+#include <memory>
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/stat.h>
 using namespace std;
 
 string loadFile(const string& filepath) {
@@ -33,21 +37,35 @@ http_response redirect(const string& url) {
     return res;
 }
 
+http_response stream_response(function<bool(string&)> producer, const string& contentType = "text/html") {
+    http_response res;
+    res.status = 200;
+    res.contentType = contentType;
+    res.stream = make_shared<StreamBody>(std::move(producer));
+    return res;
+}
+
 http_response send_from_directory(const string& directory, const string& filepath) {
     http_response res;
     string full_path = directory + "/" + filepath;
-    filesystem::path requested_path = filesystem::absolute(full_path);
-    filesystem::path base_path = filesystem::absolute(directory);
+    filesystem::path requested_path = filesystem::absolute(full_path).lexically_normal();
+    filesystem::path base_path = filesystem::absolute(directory).lexically_normal();
+    if (base_path.filename().empty()) base_path = base_path.parent_path(); // trailing slash
     
-    if (requested_path.string().find(base_path.string()) != 0) {
+    // Compared by component: as a string prefix, "/srv/static" would also
+    // admit "/srv/static-secret".
+    auto diverged = std::mismatch(base_path.begin(), base_path.end(), requested_path.begin(), requested_path.end());
+    if (diverged.first != base_path.end()) {
         res.status = 403;
         res.contentType = "text/html";
         res.body = "<h1>403 Forbidden</h1>";
         return res;
     }
     
-    ifstream file(full_path);
-    if (!file.is_open()) {
+    int fd = open(requested_path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st{};
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        if (fd >= 0) close(fd);
         res.status = 404;
         res.contentType = "text/html";
         string template_content = loadFile("./six/six_templates/404.html");
@@ -59,10 +77,6 @@ http_response send_from_directory(const string& directory, const string& filepat
         return res;
     }
     
-    stringstream buffer;
-    buffer << file.rdbuf();
-    file.close();
-    
     res.status = 200;
     
     size_t dot_pos = filepath.find_last_of(".");
@@ -84,7 +98,7 @@ http_response send_from_directory(const string& directory, const string& filepat
         res.contentType = "text/plain";
     }
     
-    res.body = buffer.str();
+    res.file = make_shared<FileBody>(fd, (size_t)st.st_size, requested_path.string(), st.st_mtime);
     return res;
 }
 
@@ -0,0 +1,255 @@
+#ifndef six_io_uring_h
+#define six_io_uring_h
+
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+// Pulled in by <linux/fs.h>; clashes with BufferPool::BLOCK_SIZE.
+#undef BLOCK_SIZE
+#define SIX_HAS_IO_URING 1
+#endif
+
+using namespace std;
+
+struct UringTimespec {
+    long long tv_sec;
+    long long tv_nsec;
+};
+
+class IoUring {
+public:
+    IoUring() = default;
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+    ~IoUring() { reset(); }
+
+#ifdef SIX_HAS_IO_URING
+    bool init(unsigned entries) {
+        io_uring_params params{};
+        ring_fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+        if (ring_fd < 0) return false;
+
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+#ifdef IORING_FEAT_EXT_ARG
+        timed_wait = params.features & IORING_FEAT_EXT_ARG;
+#endif
+        if (single_mmap) {
+            sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+        }
+
+        sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring_fd, IORING_OFF_SQ_RING);
+        if (sq_ring == MAP_FAILED) {
+            sq_ring = nullptr;
+            reset();
+            return false;
+        }
+
+        if (single_mmap) {
+            cq_ring = sq_ring;
+        } else {
+            cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           ring_fd, IORING_OFF_CQ_RING);
+            if (cq_ring == MAP_FAILED) {
+                cq_ring = nullptr;
+                reset();
+                return false;
+            }
+        }
+
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        void* sqes_map = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                              ring_fd, IORING_OFF_SQES);
+        if (sqes_map == MAP_FAILED) {
+            reset();
+            return false;
+        }
+        sqes = (io_uring_sqe*)sqes_map;
+
+        char* sq = (char*)sq_ring;
+        sq_head = (unsigned*)(sq + params.sq_off.head);
+        sq_tail = (unsigned*)(sq + params.sq_off.tail);
+        sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+        sq_array = (unsigned*)(sq + params.sq_off.array);
+        sq_entries = params.sq_entries;
+        sq_local_tail = *sq_tail;
+
+        char* cq = (char*)cq_ring;
+        cq_head = (unsigned*)(cq + params.cq_off.head);
+        cq_tail = (unsigned*)(cq + params.cq_off.tail);
+        cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+
+        return true;
+    }
+
+    bool accept(int fd, sockaddr* addr, socklen_t* addr_len, int flags, void* data) {
+        io_uring_sqe* sqe = nextSqe();
+        if (!sqe) return false;
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)addr;
+        sqe->addr2 = (uint64_t)addr_len;
+        sqe->accept_flags = flags;
+        sqe->user_data = (uint64_t)data;
+        return true;
+    }
+
+    bool recv(int fd, void* buffer, size_t length, void* data) {
+        io_uring_sqe* sqe = nextSqe();
+        if (!sqe) return false;
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)buffer;
+        sqe->len = (unsigned)length;
+        sqe->user_data = (uint64_t)data;
+        return true;
+    }
+
+    bool sendmsg(int fd, const msghdr* msg, unsigned flags, void* data) {
+        io_uring_sqe* sqe = nextSqe();
+        if (!sqe) return false;
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)msg;
+        sqe->len = 1;
+        sqe->msg_flags = flags;
+        sqe->user_data = (uint64_t)data;
+        return true;
+    }
+
+    bool poll(int fd, unsigned events, void* data) {
+        io_uring_sqe* sqe = nextSqe();
+        if (!sqe) return false;
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        sqe->poll32_events = events;
+        sqe->user_data = (uint64_t)data;
+        return true;
+    }
+
+    bool timeout(UringTimespec* ts, void* data) {
+        io_uring_sqe* sqe = nextSqe();
+        if (!sqe) return false;
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->fd = -1;
+        sqe->addr = (uint64_t)ts;
+        sqe->len = 1;
+        sqe->user_data = (uint64_t)data;
+        return true;
+    }
+
+    // Kernels from 5.11 can bound the wait without a timeout SQE.
+    bool supportsWaitTimeout() const { return timed_wait; }
+
+    // SQEs queued since the last submitAndWait().
+    bool hasUnsubmitted() const { return sq_local_tail != *sq_tail; }
+
+    // A negative `timeout_ms`, or a kernel without supportsWaitTimeout(),
+    // waits until `wait_nr` completions are ready. Fails with ETIME when the
+    // timeout passes first.
+    int submitAndWait(unsigned wait_nr, int timeout_ms = -1) {
+        unsigned to_submit = sq_local_tail - *sq_tail;
+        __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+        unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+#ifdef IORING_ENTER_EXT_ARG
+        if (timed_wait && wait_nr > 0 && timeout_ms >= 0) {
+            UringTimespec ts{timeout_ms / 1000, (timeout_ms % 1000) * 1000000LL};
+            io_uring_getevents_arg arg{};
+            arg.ts = (uint64_t)&ts;
+            return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, wait_nr, flags | IORING_ENTER_EXT_ARG,
+                                &arg, sizeof(arg));
+        }
+#endif
+        return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, wait_nr, flags, nullptr, 0);
+    }
+
+    template <typename F>
+    void forEachCompletion(F f) {
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            io_uring_cqe& cqe = cqes[head & cq_mask];
+            void* data = (void*)cqe.user_data;
+            int res = cqe.res;
+            head++;
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            f(data, res);
+        }
+    }
+
+private:
+    int ring_fd = -1;
+    bool timed_wait = false;
+    void* sq_ring = nullptr;
+    void* cq_ring = nullptr;
+    size_t sq_ring_size = 0;
+    size_t cq_ring_size = 0;
+    size_t sqes_size = 0;
+    io_uring_sqe* sqes = nullptr;
+
+    unsigned* sq_head = nullptr;
+    unsigned* sq_tail = nullptr;
+    unsigned* sq_array = nullptr;
+    unsigned sq_mask = 0;
+    unsigned sq_entries = 0;
+    unsigned sq_local_tail = 0;
+
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    io_uring_cqe* cqes = nullptr;
+
+    io_uring_sqe* nextSqe() {
+        if (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+            submitAndWait(0);
+            if (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+                return nullptr;
+            }
+        }
+        unsigned index = sq_local_tail & sq_mask;
+        io_uring_sqe* sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sq_array[index] = index;
+        sq_local_tail++;
+        return sqe;
+    }
+
+    void reset() {
+        if (sqes) munmap(sqes, sqes_size);
+        if (cq_ring && cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+        if (sq_ring) munmap(sq_ring, sq_ring_size);
+        if (ring_fd >= 0) close(ring_fd);
+        sqes = nullptr;
+        cq_ring = sq_ring = nullptr;
+        ring_fd = -1;
+    }
+#else
+    bool init(unsigned) { return false; }
+    bool accept(int, sockaddr*, socklen_t*, int, void*) { return false; }
+    bool recv(int, void*, size_t, void*) { return false; }
+    bool sendmsg(int, const msghdr*, unsigned, void*) { return false; }
+    bool poll(int, unsigned, void*) { return false; }
+    bool timeout(UringTimespec*, void*) { return false; }
+    bool supportsWaitTimeout() const { return false; }
+    bool hasUnsubmitted() const { return false; }
+    int submitAndWait(unsigned, int = -1) { return -1; }
+
+    template <typename F>
+    void forEachCompletion(F) {}
+
+private:
+    void reset() {}
+#endif
+};
+
+#endif
@@ -4,13 +4,14 @@
 #include <map>
 #include <string>
 #include <vector>
+#include <memory>
 #include "six_sessions.h"
 #include "six_sql.h"
 
 using namespace std;
 
-extern http_response* g_current_response;
-extern http_request* g_current_request;
+extern thread_local http_response* g_current_response;
+extern thread_local http_request* g_current_request;
 
 string get_client_ip_from_request(const http_request& req) {
     auto it = req.headers.find("X-Forwarded-For");
@@ -162,7 +163,17 @@ struct CurrentUser {
     }
 };
 
-CurrentUser current_user;
+// Loaded for each request on the worker handling it. Async handlers keep
+// their own copy and swap it in whenever they resume.
+thread_local CurrentUser current_user;
+
+std::shared_ptr<CurrentUser> save_current_user() {
+    return std::make_shared<CurrentUser>(current_user);
+}
+
+void swap_current_user(CurrentUser& user) {
+    std::swap(current_user, user);
+}
 
 void login_user(SQLRowRef user) {
     if (!user || !g_current_response || !g_current_request) {
@@ -0,0 +1,86 @@
+#ifndef six_lru_cache_h
+#define six_lru_cache_h
+
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+
+using namespace std;
+
+// A thread-safe map from string keys to values with a memory cap. Each entry
+// is charged the byte count given to put(); least recently used entries are
+// evicted once the total passes the cap.
+template <typename Value>
+class LruCache {
+public:
+    LruCache(size_t max_bytes) : max_bytes(max_bytes) {}
+
+    // Copies the entry for `key` into `out` and marks it recently used.
+    // Entries that fail `fresh` are dropped and count as absent.
+    template <typename Fresh>
+    bool get(const std::string& key, Value& out, Fresh&& fresh) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.find(key);
+        if (it == entries.end()) return false;
+
+        if (!fresh(it->second.value)) {
+            erase(it);
+            return false;
+        }
+        order.splice(order.begin(), order, it->second.position);
+        out = it->second.value;
+        return true;
+    }
+
+    void put(const std::string& key, Value value, size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (bytes > max_bytes) return;
+
+        auto existing = entries.find(key);
+        if (existing != entries.end()) erase(existing);
+
+        order.push_front(key);
+        used += bytes;
+        entries[key] = {std::move(value), bytes, order.begin()};
+        evict();
+    }
+
+    void setMaxBytes(size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        max_bytes = bytes;
+        evict();
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return used;
+    }
+
+private:
+    struct Entry {
+        Value value;
+        size_t bytes;
+        std::list<std::string>::iterator position;
+    };
+
+    std::mutex mutex;
+    size_t max_bytes;
+    size_t used = 0;
+    std::list<std::string> order;
+    std::unordered_map<std::string, Entry> entries;
+
+    void evict() {
+        while (used > max_bytes && !order.empty()) {
+            erase(entries.find(order.back()));
+        }
+    }
+
+    void erase(typename std::unordered_map<std::string, Entry>::iterator it) {
+        used -= it->second.bytes;
+        order.erase(it->second.position);
+        entries.erase(it);
+    }
+};
+
+#endif
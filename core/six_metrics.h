@@ -0,0 +1,221 @@
+#ifndef six_metrics_h
+#define six_metrics_h
+
+#include <string>
+#include <string_view>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+
+using namespace std;
+
+constexpr size_t METRIC_SHARDS = 16;
+
+// Each thread updates its own shard, so hot-path increments don't bounce a
+// shared cache line between cores. Readers add the shards up.
+inline size_t metric_shard() {
+    static std::atomic<size_t> next{0};
+    thread_local size_t shard = next.fetch_add(1, std::memory_order_relaxed) % METRIC_SHARDS;
+    return shard;
+}
+
+class Counter {
+public:
+    void add(uint64_t n = 1) {
+        cells[metric_shard()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t value() const {
+        uint64_t total = 0;
+        for (const auto& cell : cells) total += cell.value.load(std::memory_order_relaxed);
+        return total;
+    }
+
+private:
+    struct alignas(64) Cell {
+        std::atomic<uint64_t> value{0};
+    };
+
+    Cell cells[METRIC_SHARDS];
+};
+
+// Log-linear latency histogram in microseconds, in the style of
+// HdrHistogram: every power of two is split into SUB_COUNT linear buckets,
+// so any recorded value is off by at most 1/SUB_COUNT of itself.
+class Histogram {
+public:
+    static constexpr int SUB_BITS = 3;
+    static constexpr int SUB_COUNT = 1 << SUB_BITS;
+    static constexpr int MAGNITUDES = 32;
+    static constexpr int BUCKETS = (MAGNITUDES - SUB_BITS + 1) * SUB_COUNT;
+
+    void record(uint64_t micros) {
+        Shard& shard = shards[metric_shard()];
+        shard.counts[bucketOf(micros)].fetch_add(1, std::memory_order_relaxed);
+        shard.sum.fetch_add(micros, std::memory_order_relaxed);
+    }
+
+    struct Snapshot {
+        uint64_t counts[BUCKETS] = {};
+        uint64_t count = 0;
+        uint64_t sum = 0;
+
+        // Smallest bucket edge with at least `q` of the samples below it.
+        uint64_t percentile(double q) const {
+            uint64_t target = (uint64_t)(q * count + 0.5);
+            uint64_t seen = 0;
+            for (int i = 0; i < BUCKETS; ++i) {
+                seen += counts[i];
+                if (seen >= target && seen > 0) return upperBound(i);
+            }
+            return 0;
+        }
+    };
+
+    Snapshot snapshot() const {
+        Snapshot snap;
+        for (const auto& shard : shards) {
+            for (int i = 0; i < BUCKETS; ++i) {
+                uint64_t n = shard.counts[i].load(std::memory_order_relaxed);
+                snap.counts[i] += n;
+                snap.count += n;
+            }
+            snap.sum += shard.sum.load(std::memory_order_relaxed);
+        }
+        return snap;
+    }
+
+    static int bucketOf(uint64_t value) {
+        if (value >= (1ull << MAGNITUDES)) value = (1ull << MAGNITUDES) - 1;
+        if (value < (uint64_t)SUB_COUNT) return (int)value;
+        int magnitude = 63 - __builtin_clzll(value);
+        int sub = (int)(value >> (magnitude - SUB_BITS)) & (SUB_COUNT - 1);
+        return (magnitude - SUB_BITS + 1) * SUB_COUNT + sub;
+    }
+
+    // Exclusive upper edge of bucket `index`.
+    static uint64_t upperBound(int index) {
+        if (index < SUB_COUNT) return index + 1;
+        int magnitude = index / SUB_COUNT + SUB_BITS - 1;
+        uint64_t width = 1ull << (magnitude - SUB_BITS);
+        return (uint64_t)(SUB_COUNT + index % SUB_COUNT) * width + width;
+    }
+
+private:
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> counts[BUCKETS] = {};
+        std::atomic<uint64_t> sum{0};
+    };
+
+    Shard shards[METRIC_SHARDS];
+};
+
+// Records the time from construction to destruction.
+class ScopedTimer {
+public:
+    explicit ScopedTimer(Histogram& histogram)
+        : histogram(histogram), started(std::chrono::steady_clock::now()) {}
+
+    ~ScopedTimer() {
+        histogram.record(std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - started).count());
+    }
+
+private:
+    Histogram& histogram;
+    std::chrono::steady_clock::time_point started;
+};
+
+enum class SqlOp { Exec, Insert, FindBy, FindByReadonly, FindByAndDelete, QueryAll, GetColumns, Commit, Count };
+
+constexpr const char* SQL_OP_NAMES[(size_t)SqlOp::Count] = {
+    "exec", "insert", "find_by", "find_by_readonly", "find_by_and_delete", "query_all", "get_columns", "commit",
+};
+
+inline Histogram& sql_histogram(SqlOp op) {
+    static Histogram histograms[(size_t)SqlOp::Count];
+    return histograms[(size_t)op];
+}
+
+// Builds a Prometheus text exposition (format 0.0.4).
+class MetricsText {
+public:
+    void family(const char* name, const char* type, const char* help) {
+        out += "# HELP ";
+        out += name;
+        out += ' ';
+        out += help;
+        out += "\n# TYPE ";
+        out += name;
+        out += ' ';
+        out += type;
+        out += '\n';
+    }
+
+    // `labels` is the inside of the braces, already escaped, or empty.
+    void sample(std::string_view name, std::string_view labels, double value) {
+        out += name;
+        if (!labels.empty()) {
+            out += '{';
+            out += labels;
+            out += '}';
+        }
+        out += ' ';
+        char number[32];
+        snprintf(number, sizeof(number), "%.17g", value);
+        out += number;
+        out += '\n';
+    }
+
+    // Histograms without samples are left out to keep the page short.
+    void histogram(const std::string& name, const std::string& labels, const Histogram& histogram) {
+        static const double bounds[] = {0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05,
+                                        0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+
+        Histogram::Snapshot snap = histogram.snapshot();
+        if (snap.count == 0) return;
+        std::string prefix = labels.empty() ? "" : labels + ",";
+
+        // A bucket counts towards `le` once its whole range lies below it.
+        int bucket = 0;
+        uint64_t cumulative = 0;
+        for (double bound : bounds) {
+            uint64_t bound_us = (uint64_t)(bound * 1e6);
+            while (bucket < Histogram::BUCKETS && Histogram::upperBound(bucket) <= bound_us) {
+                cumulative += snap.counts[bucket++];
+            }
+            char le[32];
+            snprintf(le, sizeof(le), "%g", bound);
+            sample(name + "_bucket", prefix + "le=\"" + le + "\"", (double)cumulative);
+        }
+        sample(name + "_bucket", prefix + "le=\"+Inf\"", (double)snap.count);
+        sample(name + "_sum", labels, snap.sum / 1e6);
+        sample(name + "_count", labels, (double)snap.count);
+    }
+
+    static std::string label(std::string_view key, std::string_view value) {
+        std::string text(key);
+        text += "=\"";
+        for (char c : value) {
+            if (c == '\\' || c == '"') {
+                text += '\\';
+                text += c;
+            } else if (c == '\n') {
+                text += "\\n";
+            } else {
+                text += c;
+            }
+        }
+        text += '"';
+        return text;
+    }
+
+    std::string& str() { return out; }
+
+private:
+    std::string out;
+};
+
+#endif
@@ -0,0 +1,338 @@
+#ifndef six_multipart_h
+#define six_multipart_h
+
+#include <string>
+#include <string_view>
+#include <map>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <fcntl.h>
+
+using namespace std;
+
+// Removes the file at `path` when the last upload referring to it is gone,
+// unless `path` has been cleared because the file was moved elsewhere.
+struct TempFile {
+    std::string path;
+
+    TempFile(std::string path) : path(std::move(path)) {}
+    TempFile(const TempFile&) = delete;
+    TempFile& operator=(const TempFile&) = delete;
+    ~TempFile() { if (!path.empty()) unlink(path.c_str()); }
+};
+
+struct UploadedFile {
+    std::string name;
+    std::string filename;
+    std::string content_type;
+    mutable std::string path; // where the file is now; save() moves it
+    size_t size = 0;
+    std::shared_ptr<TempFile> temp;
+
+    // The temp file is removed once the request is done with it, so keep an
+    // upload by saving it somewhere else. `path` then names `dest`.
+    bool save(const std::string& dest) const {
+        if (rename(path.c_str(), dest.c_str()) == 0) {
+            // The name is free again, and mkostemp may hand it to another upload.
+            if (temp && temp->path == path) temp->path.clear();
+            path = dest;
+            return true;
+        }
+        if (errno != EXDEV || !copyTo(dest)) return false;
+        path = dest;
+        return true;
+    }
+
+private:
+    // Across filesystems the upload is copied to a temp file beside `dest`
+    // and renamed over it, so `dest` never holds a partial copy.
+    bool copyTo(const std::string& dest) const {
+        int in = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (in < 0) return false;
+
+        std::string staging = dest + ".six-XXXXXX";
+        int out = mkostemp(staging.data(), O_CLOEXEC);
+        if (out < 0) {
+            close(in);
+            return false;
+        }
+
+        bool ok = copyFd(in, out);
+        close(in);
+        if (close(out) != 0) ok = false;
+        if (ok && rename(staging.c_str(), dest.c_str()) == 0) return true;
+        unlink(staging.c_str());
+        return false;
+    }
+
+    static bool copyFd(int in, int out) {
+        char buffer[65536];
+        while (true) {
+            ssize_t n = ::read(in, buffer, sizeof(buffer));
+            if (n == 0) return true;
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            for (ssize_t done = 0; done < n;) {
+                ssize_t written = ::write(out, buffer + done, n - done);
+                if (written < 0) {
+                    if (errno == EINTR) continue;
+                    return false;
+                }
+                done += written;
+            }
+        }
+    }
+};
+
+// Incremental multipart/form-data parser. Bytes are fed as they arrive off
+// the socket; plain fields are collected in memory, file parts are written
+// straight to temp files, so only one delimiter's worth of input is held
+// back between calls.
+class MultipartParser {
+public:
+    static constexpr size_t MAX_PART_HEADER_SIZE = 16384;
+
+    std::map<std::string, std::string> fields;
+    std::multimap<std::string, UploadedFile> files; // in the order they were sent
+
+    MultipartParser(const std::string& boundary, const std::string& upload_dir, size_t max_field_bytes)
+        : delimiter("\r\n--" + boundary),
+          searcher(delimiter.begin(), delimiter.end()),
+          upload_dir(upload_dir),
+          max_field_bytes(max_field_bytes),
+          pending("\r\n") {}
+
+    MultipartParser(const MultipartParser&) = delete;
+    MultipartParser& operator=(const MultipartParser&) = delete;
+    ~MultipartParser() { closeFile(); }
+
+    void feed(const char* data, size_t n) {
+        if (status != 0) return;
+        pending.append(data, n);
+
+        size_t start = 0;
+        while (status == 0 && parse(start)) {}
+        pending.erase(0, start);
+    }
+
+    bool finish() {
+        if (state != Done && status == 0) status = 400;
+        return status == 0;
+    }
+
+    // 0 while the body is well formed, otherwise the HTTP status to reject it with.
+    int error() const { return status; }
+
+private:
+    enum State { Preamble, BoundaryLine, Headers, Body, Done };
+
+    std::string delimiter;
+    std::boyer_moore_horspool_searcher<std::string::const_iterator> searcher;
+    std::string upload_dir;
+    size_t max_field_bytes;
+    size_t field_bytes = 0;
+    std::string pending;
+    State state = Preamble;
+    int status = 0;
+
+    std::string part_name;
+    bool part_is_file = false;
+    std::string field_value;
+    UploadedFile upload;
+    int file_fd = -1;
+
+    size_t findDelimiter(size_t start) const {
+        auto it = std::search(pending.begin() + start, pending.end(), searcher);
+        return it == pending.end() ? std::string::npos : (size_t)(it - pending.begin());
+    }
+
+    // Consumes what it can from pending[start..]; false when more input is needed.
+    bool parse(size_t& start) {
+        switch (state) {
+            case Preamble: {
+                size_t pos = findDelimiter(start);
+                if (pos == std::string::npos) {
+                    start = std::max(start, pending.size() - std::min(pending.size(), delimiter.size() - 1));
+                    return false;
+                }
+                start = pos + delimiter.size();
+                state = BoundaryLine;
+                return true;
+            }
+
+            case BoundaryLine: {
+                if (pending.size() - start < 2) return false;
+                if (pending.compare(start, 2, "--") == 0) {
+                    state = Done;
+                } else if (pending.compare(start, 2, "\r\n") == 0) {
+                    state = Headers;
+                } else {
+                    status = 400;
+                    return false;
+                }
+                start += 2;
+                return true;
+            }
+
+            case Headers: {
+                size_t end;
+                if (pending.compare(start, 2, "\r\n") == 0) {
+                    end = start;
+                } else {
+                    end = pending.find("\r\n\r\n", start);
+                    if (end == std::string::npos) {
+                        if (pending.size() - start > MAX_PART_HEADER_SIZE) status = 400;
+                        return false;
+                    }
+                    end += 2;
+                }
+                openPart(std::string_view(pending).substr(start, end - start));
+                start = end + 2;
+                if (status == 0) state = Body;
+                return true;
+            }
+
+            case Body: {
+                size_t pos = findDelimiter(start);
+                if (pos == std::string::npos) {
+                    size_t keep = std::min(pending.size() - start, delimiter.size() - 1);
+                    size_t end = pending.size() - keep;
+                    writePart(pending.data() + start, end - start);
+                    start = end;
+                    return false;
+                }
+                writePart(pending.data() + start, pos - start);
+                start = pos + delimiter.size();
+                closePart();
+                state = BoundaryLine;
+                return true;
+            }
+
+            case Done:
+                start = pending.size();
+                return false;
+        }
+        return false;
+    }
+
+    static std::string headerParam(std::string_view value, const std::string& key) {
+        size_t pos = 0;
+        while (pos < value.size()) {
+            size_t end = value.find(';', pos);
+            if (end == std::string_view::npos) end = value.size();
+            std::string_view item = value.substr(pos, end - pos);
+            pos = end + 1;
+
+            while (!item.empty() && isspace((unsigned char)item.front())) item.remove_prefix(1);
+            size_t eq = item.find('=');
+            if (eq == std::string_view::npos || item.substr(0, eq) != key) continue;
+
+            std::string_view param = item.substr(eq + 1);
+            while (!param.empty() && isspace((unsigned char)param.back())) param.remove_suffix(1);
+            if (param.size() >= 2 && param.front() == '"' && param.back() == '"') {
+                param = param.substr(1, param.size() - 2);
+            }
+            return std::string(param);
+        }
+        return "";
+    }
+
+    void openPart(std::string_view headers) {
+        part_name.clear();
+        part_is_file = false;
+        field_value.clear();
+        upload = UploadedFile();
+
+        size_t pos = 0;
+        while (pos < headers.size()) {
+            size_t end = headers.find("\r\n", pos);
+            if (end == std::string_view::npos) end = headers.size();
+            std::string_view line = headers.substr(pos, end - pos);
+            pos = end + 2;
+
+            size_t colon = line.find(':');
+            if (colon == std::string_view::npos) continue;
+            std::string key(line.substr(0, colon));
+            transform(key.begin(), key.end(), key.begin(), ::tolower);
+            std::string_view value = line.substr(colon + 1);
+            while (!value.empty() && isspace((unsigned char)value.front())) value.remove_prefix(1);
+
+            if (key == "content-disposition") {
+                part_name = headerParam(value, "name");
+                upload.filename = headerParam(value, "filename");
+                part_is_file = value.find("filename=") != std::string_view::npos;
+            } else if (key == "content-type") {
+                upload.content_type = std::string(value);
+            }
+        }
+
+        if (!part_is_file || part_name.empty()) return;
+
+        std::string path = upload_dir + "/six-upload-XXXXXX";
+        file_fd = mkostemp(path.data(), O_CLOEXEC);
+        if (file_fd < 0) {
+            perror("[ERROR] mkostemp");
+            status = 500;
+            return;
+        }
+        upload.name = part_name;
+        upload.path = path;
+        upload.temp = std::make_shared<TempFile>(path);
+    }
+
+    void writePart(const char* data, size_t n) {
+        if (n == 0 || part_name.empty()) return;
+
+        if (!part_is_file) {
+            field_bytes += n;
+            if (field_bytes > max_field_bytes) {
+                status = 413;
+                return;
+            }
+            field_value.append(data, n);
+            return;
+        }
+
+        upload.size += n;
+        while (n > 0) {
+            ssize_t written = ::write(file_fd, data, n);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                perror("[ERROR] upload write");
+                status = 500;
+                return;
+            }
+            data += written;
+            n -= written;
+        }
+    }
+
+    void closePart() {
+        if (part_name.empty()) return;
+
+        if (part_is_file) {
+            closeFile();
+            files.emplace(part_name, std::move(upload));
+        } else {
+            fields[part_name] = std::move(field_value);
+        }
+        part_name.clear();
+    }
+
+    void closeFile() {
+        if (file_fd >= 0) {
+            close(file_fd);
+            file_fd = -1;
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef six_response_cache_h
+#define six_response_cache_h
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <atomic>
+#include <chrono>
+
+#include "six_lru_cache.h"
+
+using namespace std;
+
+// Caching for a GET route, passed to six::get(). Entries are kept per path,
+// query string and content encoding, plus the Cookie header with
+// `vary_on_cookie` and any headers named in `vary_headers`.
+struct cache_policy {
+    int ttl = 60; // seconds
+    bool vary_on_cookie = false;
+    std::vector<std::string> vary_headers;
+};
+
+// A handler's response as it goes out, after compression: everything but
+// the per-connection head fields (Date, Connection, Content-Length). Hits
+// send the body from here without copying it.
+struct CachedResponse {
+    int status = 200;
+    std::string content_type;
+    std::string location;
+    std::map<std::string, std::string> headers;
+    std::shared_ptr<const std::string> body;
+
+    size_t bytes() const {
+        size_t n = sizeof(CachedResponse) + content_type.size() + location.size() + (body ? body->size() : 0);
+        for (const auto& [key, value] : headers) n += key.size() + value.size();
+        return n;
+    }
+};
+
+// Whole responses shared by all shards and workers. Each entry expires after
+// its route's TTL; least recently used entries are evicted once the total
+// passes the memory cap.
+class ResponseCache {
+public:
+    using clock = std::chrono::steady_clock;
+
+    ResponseCache(size_t max_bytes = 64 * 1024 * 1024) : cache(max_bytes) {}
+
+    std::shared_ptr<const CachedResponse> get(const std::string& key) {
+        Entry entry;
+        auto now = clock::now();
+        if (!cache.get(key, entry, [&](const Entry& e) { return now < e.expires; })) {
+            misses.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        hits.fetch_add(1, std::memory_order_relaxed);
+        return entry.response;
+    }
+
+    void put(const std::string& key, std::shared_ptr<const CachedResponse> response, int ttl_seconds) {
+        if (ttl_seconds <= 0) return;
+        size_t bytes = key.size() + response->bytes();
+        cache.put(key, {clock::now() + std::chrono::seconds(ttl_seconds), std::move(response)}, bytes);
+    }
+
+    void setMaxBytes(size_t bytes) { cache.setMaxBytes(bytes); }
+    size_t size() { return cache.size(); }
+
+    uint64_t hitCount() const { return hits.load(std::memory_order_relaxed); }
+    uint64_t missCount() const { return misses.load(std::memory_order_relaxed); }
+
+private:
+    struct Entry {
+        clock::time_point expires;
+        std::shared_ptr<const CachedResponse> response;
+    };
+
+    LruCache<Entry> cache;
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+};
+
+#endif
@@ -6,6 +6,7 @@
 #include <map>
 #include <vector>
 #include <sqlite3.h>
+#include "six_metrics.h"
 
 using namespace std;
 
@@ -119,6 +120,7 @@ public:
 };
 
 vector<string> six_sql_get_columns(const char *table) {
+    ScopedTimer timer(sql_histogram(SqlOp::GetColumns));
     sqlite3* db;
     sqlite3_stmt* stmt;
     vector<string> columns;
@@ -152,6 +154,7 @@ vector<string> six_sql_get_columns(const char *table) {
 }
 
 void six_sql_exec(const char *sql) {
+    ScopedTimer timer(sql_histogram(SqlOp::Exec));
     sqlite3* db;
     char *errMsg = NULL;
 
@@ -174,6 +177,7 @@ void six_sql_exec(const char *sql) {
 }
 
 void six_sql_insert(const char *table, const map<string, string> &data) {
+    ScopedTimer timer(sql_histogram(SqlOp::Insert));
     sqlite3* db;
     sqlite3_stmt* stmt;
 
@@ -227,6 +231,7 @@ void six_sql_insert(const char *table, const map<string, string> &data) {
 }
 
 SQLRowRef six_sql_find_by(const char *table, const char *column, const char *value) {
+    ScopedTimer timer(sql_histogram(SqlOp::FindBy));
     sqlite3* db;
     sqlite3_stmt* stmt;
 
@@ -278,6 +283,7 @@ SQLRowRef six_sql_find_by(const char *table, const char *column, const string &v
 }
 
 SQLRow six_sql_find_by_readonly(const char *table, const char *column, const char *value) {
+    ScopedTimer timer(sql_histogram(SqlOp::FindByReadonly));
     sqlite3* db;
     sqlite3_stmt* stmt;
 
@@ -321,6 +327,7 @@ SQLRow six_sql_find_by_readonly(const char *table, const char *column, const str
 }
 
 bool six_sql_find_by_and_delete(const char *table, const char *column, const char *value) {
+    ScopedTimer timer(sql_histogram(SqlOp::FindByAndDelete));
     sqlite3* db;
     sqlite3_stmt* stmt;
 
@@ -380,6 +387,7 @@ bool six_sql_find_by_and_delete(const char *table, const char *column, const str
 }
 
 vector<SQLRow> six_sql_query_all(const char *table) {
+    ScopedTimer timer(sql_histogram(SqlOp::QueryAll));
     sqlite3* db;
     sqlite3_stmt* stmt;
     vector<SQLRow> results;
@@ -419,6 +427,7 @@ vector<SQLRow> six_sql_query_all(const char *table) {
 }
 
 void six_sql_commit() {
+    ScopedTimer timer(sql_histogram(SqlOp::Commit));
     sqlite3* db;
 
     int rc = sqlite3_open(database_path, &db);
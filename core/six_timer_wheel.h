@@ -0,0 +1,142 @@
+#ifndef six_timer_wheel_h
+#define six_timer_wheel_h
+
+#include <cstdint>
+#include <cstddef>
+
+using namespace std;
+
+// Intrusive link for TimerWheel; embed it in whatever owns the timer.
+struct TimerNode {
+    TimerNode* prev = nullptr;
+    TimerNode* next = nullptr;
+    uint64_t expires = 0;
+
+    bool armed() const { return next != nullptr; }
+};
+
+// Hierarchical timing wheel. Time is counted in ticks; level 0 has one slot
+// per tick and every level above covers SLOTS times the span of the one
+// below. A timer goes into the coarsest level that can hold it and moves
+// down a level each time the wheel reaches its slot, so schedule() and
+// cancel() are O(1) however many timers are armed. Not thread-safe.
+class TimerWheel {
+public:
+    static constexpr int SLOT_BITS = 6;
+    static constexpr int SLOTS = 1 << SLOT_BITS;
+    static constexpr int LEVELS = 4;
+    static constexpr uint64_t MAX_SPAN = 1ull << (SLOT_BITS * LEVELS);
+    static constexpr uint64_t NEVER = UINT64_MAX;
+
+    explicit TimerWheel(uint64_t now = 0) : current(now) {
+        for (auto& level : slots) {
+            for (auto& head : level) {
+                head.prev = head.next = &head;
+            }
+        }
+    }
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    // Re-arms `node` if it is already scheduled. Ticks in the past fire on
+    // the next advance().
+    void schedule(TimerNode& node, uint64_t expires) {
+        if (node.armed()) unlink(node);
+        else count++;
+        node.expires = expires;
+        link(node);
+    }
+
+    void cancel(TimerNode& node) {
+        if (!node.armed()) return;
+        unlink(node);
+        count--;
+    }
+
+    size_t size() const { return count; }
+
+    // Fires every timer due at or before `now`. `expire` may schedule or
+    // cancel any timer, including the one it was called for.
+    template <typename Expire>
+    void advance(uint64_t now, Expire expire) {
+        if (count == 0) {
+            if (now >= current) current = now + 1;
+            return;
+        }
+
+        while (current <= now) {
+            for (int level = LEVELS - 1; level > 0; --level) {
+                if ((current & (span(level) - 1)) == 0) {
+                    cascade(slots[level][(current >> (SLOT_BITS * level)) & (SLOTS - 1)]);
+                }
+            }
+
+            TimerNode& head = slots[0][current & (SLOTS - 1)];
+            while (head.next != &head) {
+                TimerNode* node = head.next;
+                unlink(*node);
+                if (node->expires > current) {
+                    // Parked at the far edge because it was beyond MAX_SPAN.
+                    link(*node);
+                    continue;
+                }
+                count--;
+                expire(*node);
+            }
+            current++;
+        }
+    }
+
+    // The earliest tick at which advance() has work to do, either firing a
+    // level 0 slot or pulling timers down from a higher level. NEVER when
+    // nothing is armed.
+    uint64_t nextTick() const {
+        if (count == 0) return NEVER;
+        uint64_t boundary = (current | (SLOTS - 1)) + 1;
+        for (uint64_t tick = current; tick < boundary; ++tick) {
+            const TimerNode& head = slots[0][tick & (SLOTS - 1)];
+            if (head.next != &head) return tick;
+        }
+        return boundary;
+    }
+
+private:
+    TimerNode slots[LEVELS][SLOTS];
+    uint64_t current; // next tick to process
+    size_t count = 0;
+
+    static constexpr uint64_t span(int level) {
+        return 1ull << (SLOT_BITS * level);
+    }
+
+    void link(TimerNode& node) {
+        uint64_t expires = node.expires > current ? node.expires : current;
+        if (expires - current >= MAX_SPAN) expires = current + MAX_SPAN - 1;
+
+        int level = 0;
+        while (level < LEVELS - 1 && expires - current >= span(level + 1)) level++;
+
+        TimerNode& head = slots[level][(expires >> (SLOT_BITS * level)) & (SLOTS - 1)];
+        node.prev = head.prev;
+        node.next = &head;
+        head.prev->next = &node;
+        head.prev = &node;
+    }
+
+    static void unlink(TimerNode& node) {
+        node.prev->next = node.next;
+        node.next->prev = node.prev;
+        node.prev = node.next = nullptr;
+    }
+
+    void cascade(TimerNode& head) {
+        while (head.next != &head) {
+            TimerNode* node = head.next;
+            unlink(*node);
+            link(*node);
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,213 @@
+#ifndef six_tls_h
+#define six_tls_h
+
+#include <string>
+#include <cerrno>
+#include <climits>
+#include <algorithm>
+#include <iostream>
+#include <sys/types.h>
+
+#if __has_include(<openssl/ssl.h>)
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#define SIX_HAS_TLS 1
+#endif
+
+using namespace std;
+
+// Largest TLS record payload; writes without kernel TLS are cut to this.
+constexpr size_t TLS_RECORD_SIZE = 16384;
+
+// Certificate, key and settings shared by every TLS connection. A single
+// context serves all shards, so a session ticket issued on one shard
+// resumes on any other.
+class TlsContext {
+public:
+    TlsContext() = default;
+    TlsContext(const TlsContext&) = delete;
+    TlsContext& operator=(const TlsContext&) = delete;
+
+#ifdef SIX_HAS_TLS
+    ~TlsContext() { if (ctx) SSL_CTX_free(ctx); }
+
+    // False, with the reason on stderr, if the certificate chain or key
+    // can't be loaded. With `http2`, ALPN offers h2 ahead of http/1.1.
+    bool init(const std::string& cert_file, const std::string& key_file, bool http2) {
+        ctx = SSL_CTX_new(TLS_server_method());
+        if (!ctx) return fail("SSL_CTX_new");
+        alpn_h2 = http2;
+
+        SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+        // With ENABLE_KTLS, OpenSSL hands the write side to the kernel at the
+        // end of the handshake if both support the cipher, after which plain
+        // writes and sendfile() on the socket are encrypted by the kernel.
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE);
+        SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER
+                              | SSL_MODE_RELEASE_BUFFERS);
+
+        // Resumption: tickets (TLS 1.3 and 1.2) are sealed with a key made
+        // along with the context; TLS 1.2 clients without tickets hit the
+        // server-side session cache instead.
+        SSL_CTX_set_session_id_context(ctx, (const unsigned char*)"six", 3);
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+
+        if (SSL_CTX_use_certificate_chain_file(ctx, cert_file.c_str()) != 1) return fail(cert_file.c_str());
+        if (SSL_CTX_use_PrivateKey_file(ctx, key_file.c_str(), SSL_FILETYPE_PEM) != 1) return fail(key_file.c_str());
+        if (SSL_CTX_check_private_key(ctx) != 1) return fail("certificate and key don't match");
+
+        SSL_CTX_set_alpn_select_cb(ctx, selectProtocol, this);
+        return true;
+    }
+
+    SSL_CTX* get() const { return ctx; }
+
+private:
+    SSL_CTX* ctx = nullptr;
+    bool alpn_h2 = false;
+
+    static bool fail(const char* what) {
+        unsigned long error = ERR_get_error();
+        char reason[256] = "unknown error";
+        if (error) ERR_error_string_n(error, reason, sizeof(reason));
+        cerr << "[ERROR] TLS: " << what << ": " << reason << endl;
+        ERR_clear_error();
+        return false;
+    }
+
+    static int selectProtocol(SSL*, const unsigned char** out, unsigned char* out_len,
+                              const unsigned char* in, unsigned int in_len, void* arg) {
+        static const unsigned char with_h2[] = "\x02h2\x08http/1.1";
+        static const unsigned char http11[] = "\x08http/1.1";
+        bool h2 = static_cast<TlsContext*>(arg)->alpn_h2;
+        const unsigned char* ours = h2 ? with_h2 : http11;
+        unsigned int ours_len = h2 ? sizeof(with_h2) - 1 : sizeof(http11) - 1;
+
+        unsigned char* selected = nullptr;
+        if (SSL_select_next_proto(&selected, out_len, ours, ours_len, in, in_len) != OPENSSL_NPN_NEGOTIATED) {
+            return SSL_TLSEXT_ERR_NOACK;
+        }
+        *out = selected;
+        return SSL_TLSEXT_ERR_OK;
+    }
+#else
+    bool init(const std::string&, const std::string&, bool) {
+        cerr << "[ERROR] TLS: built without OpenSSL headers" << endl;
+        return false;
+    }
+#endif
+};
+
+// Server side of one TLS connection. Ciphertext the event loop reads off
+// the socket, by read() or an io_uring recv, is fed in through a memory
+// BIO; records go out on the socket directly, which is what lets OpenSSL
+// move the write side into the kernel.
+class TlsConnection {
+public:
+    enum Status { Ok, WantRead, WantWrite, Closed, Failed };
+
+    TlsConnection(const TlsConnection&) = delete;
+    TlsConnection& operator=(const TlsConnection&) = delete;
+
+    // Whether the kernel encrypts writes, so plain write() and sendfile()
+    // on the socket stand in for write() below.
+    bool kernelSend() const { return kernel_send; }
+
+    // The last read() stopped because a handshake record couldn't be
+    // written; read again once the socket is writable.
+    bool readBlocked() const { return read_blocked; }
+
+#ifdef SIX_HAS_TLS
+    TlsConnection(const TlsContext& context, int fd) {
+        ssl = SSL_new(context.get());
+        BIO* rbio = BIO_new(BIO_s_mem());
+        BIO* wbio = BIO_new_socket(fd, BIO_NOCLOSE);
+        if (!ssl || !rbio || !wbio) {
+            BIO_free(rbio);
+            BIO_free(wbio);
+            if (ssl) SSL_free(ssl);
+            ssl = nullptr;
+            return;
+        }
+        BIO_set_mem_eof_return(rbio, -1); // an empty buffer means "more to come", not EOF
+        SSL_set_bio(ssl, rbio, wbio);
+        SSL_set_accept_state(ssl);
+    }
+
+    ~TlsConnection() { if (ssl) SSL_free(ssl); }
+
+    bool valid() const { return ssl != nullptr; }
+
+    void feed(const char* data, size_t n) {
+        BIO_write(SSL_get_rbio(ssl), data, (int)n);
+    }
+
+    // Decrypts into `out`, advancing the handshake first if it isn't done.
+    // `n` is set to the bytes produced.
+    Status read(char* out, size_t capacity, size_t& n) {
+        n = 0;
+        ERR_clear_error();
+        int result = SSL_read(ssl, out, (int)std::min(capacity, (size_t)INT_MAX));
+        if (!kernel_send && SSL_is_init_finished(ssl)) {
+            kernel_send = BIO_get_ktls_send(SSL_get_wbio(ssl));
+        }
+        if (result > 0) {
+            n = result;
+            read_blocked = false;
+            return Ok;
+        }
+        Status status = errorStatus(result);
+        read_blocked = status == WantWrite;
+        return status;
+    }
+
+    // write()'s contract: the bytes taken, or -1 with errno set (EAGAIN when
+    // the socket is full). A retry after EAGAIN must pass the same bytes.
+    ssize_t write(const void* data, size_t n) {
+        ERR_clear_error();
+        int result = SSL_write(ssl, data, (int)std::min(n, (size_t)INT_MAX));
+        if (result > 0) return result;
+        Status status = errorStatus(result);
+        errno = status == WantRead || status == WantWrite ? EAGAIN : EPIPE;
+        return -1;
+    }
+
+    // Sends close_notify if the socket takes it; no waiting for the peer's.
+    void close() {
+        ERR_clear_error();
+        SSL_shutdown(ssl);
+        ERR_clear_error();
+    }
+
+    bool handshakeDone() const { return SSL_is_init_finished(ssl); }
+    bool resumed() const { return SSL_session_reused(ssl); }
+
+private:
+    SSL* ssl = nullptr;
+
+    Status errorStatus(int result) {
+        switch (SSL_get_error(ssl, result)) {
+            case SSL_ERROR_WANT_READ: return WantRead;
+            case SSL_ERROR_WANT_WRITE: return WantWrite;
+            case SSL_ERROR_ZERO_RETURN: return Closed;
+            default: return Failed;
+        }
+    }
+#else
+    TlsConnection(const TlsContext&, int) {}
+
+    bool valid() const { return false; }
+    void feed(const char*, size_t) {}
+    Status read(char*, size_t, size_t& n) { n = 0; return Failed; }
+    ssize_t write(const void*, size_t) { errno = EPIPE; return -1; }
+    void close() {}
+    bool handshakeDone() const { return false; }
+    bool resumed() const { return false; }
+#endif
+
+private:
+    bool kernel_send = false;
+    bool read_blocked = false;
+};
+
+#endif
@@ -2,6 +2,7 @@
 #define six_h
 
 #include "core/six_http_server.h"
+#include "core/six_async.h"
 #include "core/six_http_utils.h"
 #include "core/six_sql.h"
 #include "core/six_tpl_engine.h"
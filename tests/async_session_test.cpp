@@ -0,0 +1,115 @@
+// Signed-in user checks for async handlers that interleave on the same workers.
+//
+// Build and run from the repository root:
+//   g++ -std=c++20 -pthread tests/async_session_test.cpp -o async_session_test -lsqlite3 -largon2 -lz -lssl -lcrypto && ./async_session_test
+
+#include <cstdlib>
+#include <unistd.h>
+
+// six_sessions.h creates its tables in ./app.db as the program starts, so
+// move to a scratch directory before it does.
+static char scratch[] = "/tmp/six_async_session_XXXXXX";
+static bool in_scratch = mkdtemp(scratch) && chdir(scratch) == 0;
+
+#include "../six.h"
+#include <cstdio>
+
+static int failures = 0;
+static int port = 0;
+
+static int free_port() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    ::bind(fd, (sockaddr*)&addr, sizeof(addr));
+    getsockname(fd, (sockaddr*)&addr, &len);
+    close(fd);
+    return ntohs(addr.sin_port);
+}
+
+static int connect_server() {
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    for (int attempt = 0; attempt < 100; ++attempt) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0) return fd;
+        close(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    return -1;
+}
+
+// Fetches `path` with the given session cookie and returns the body.
+static string fetch(const string& path, const string& session_id) {
+    int fd = connect_server();
+    if (fd < 0) return "";
+    timeval timeout{2, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    string request = "GET " + path + " HTTP/1.1\r\nHost: t\r\nUser-Agent: test\r\n"
+                     "Cookie: session_id=" + session_id + "\r\nConnection: close\r\n\r\n";
+    send(fd, request.data(), request.size(), MSG_NOSIGNAL);
+
+    string response;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+        response.append(buffer, n);
+    }
+    close(fd);
+    size_t body = response.find("\r\n\r\n");
+    return body == string::npos ? "" : response.substr(body + 4);
+}
+
+static void expect(const char* name, const string& got, const string& want) {
+    if (got != want) {
+        printf("FAIL %s: got \"%s\", want \"%s\"\n", name, got.c_str(), want.c_str());
+        failures++;
+    }
+}
+
+int main() {
+    if (!in_scratch) return 1;
+    init_database();
+    six_sql_exec("CREATE TABLE IF NOT EXISTS users (id INTEGER PRIMARY KEY, name TEXT);");
+    six_sql_insert("users", {{"id", "1"}, {"name", "alice"}});
+    six_sql_insert("users", {{"id", "2"}, {"name", "bob"}});
+    string alice = create_session(1, "127.0.0.1", "test").session_id;
+    string bob = create_session(2, "127.0.0.1", "test").session_id;
+
+    port = free_port();
+    static six server(port, 2);
+    server.setAccessLog(LogFormat::Off);
+    server.get_async("/whoami", [](http_request) -> async_response {
+        string before = current_user.get("name");
+        co_await sleep_for(std::chrono::milliseconds(100));
+        string after = current_user.get("name");
+        co_await run_blocking([] {});
+        co_return before + " " + after + " " + current_user.get("name");
+    });
+    std::thread([] { server.start(); }).detach();
+
+    // Clients of both users in flight at once, more of them than workers, so
+    // each handler resumes after others have run on its worker.
+    const int clients = 8;
+    std::vector<string> answers(clients * 2);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < clients * 2; ++i) {
+        threads.emplace_back([&, i] { answers[i] = fetch("/whoami", i % 2 ? bob : alice); });
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    for (auto& thread : threads) thread.join();
+    for (int i = 0; i < clients * 2; ++i) {
+        expect(i % 2 ? "bob's session" : "alice's session", answers[i], i % 2 ? "bob bob bob" : "alice alice alice");
+    }
+
+    for (const char* file : {"app.db", "app.db-wal", "app.db-shm"}) unlink(file);
+    rmdir(scratch);
+    if (failures == 0) printf("ok\n");
+    fflush(stdout);
+    // The server never returns from start(), so skip static destruction.
+    _exit(failures == 0 ? 0 : 1);
+}
@@ -0,0 +1,38 @@
+// Accept-Encoding negotiation checks.
+//
+// Build and run from the repository root:
+//   g++ -std=c++17 tests/compress_test.cpp -o compress_test -lz && ./compress_test
+
+#include "../core/six_compress.h"
+#include <cstdio>
+
+static int failures = 0;
+
+static void expect(const char* accept, Encoding expected) {
+    Encoding got = negotiate_encoding(accept);
+    if (got != expected) {
+        printf("FAIL \"%s\": got %s, want %s\n", accept, encoding_name(got), encoding_name(expected));
+        failures++;
+    }
+}
+
+int main() {
+#ifdef SIX_HAS_ZLIB
+    expect("", Encoding::Identity);
+    expect("gzip", Encoding::Gzip);
+    expect("deflate", Encoding::Deflate);
+    expect("gzip, deflate, br", Encoding::Gzip);
+    expect("x-gzip", Encoding::Gzip);
+    expect("gzip;q=0, deflate", Encoding::Deflate);
+    expect("*", Encoding::Gzip);
+    expect("*;q=0", Encoding::Identity);
+    expect("gzip;q=0, *", Encoding::Deflate);
+    expect("gzip;q=0, deflate;q=0, *", Encoding::Identity);
+    expect("deflate, *;q=0", Encoding::Deflate);
+    expect("br", Encoding::Identity);
+#else
+    expect("gzip", Encoding::Identity);
+#endif
+    if (failures == 0) printf("ok\n");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,108 @@
+// Multipart parser checks: fields and files fed in small pieces, several
+// files under one field name, and where an upload's path points after save().
+//
+// Build and run from the repository root:
+//   g++ -std=c++17 tests/multipart_test.cpp -o multipart_test && ./multipart_test
+
+#include "../core/six_multipart.h"
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <sys/stat.h>
+
+static int failures = 0;
+
+static void expect(bool ok, const char* what) {
+    if (!ok) {
+        printf("FAIL %s\n", what);
+        failures++;
+    }
+}
+
+static std::string slurp(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    std::stringstream data;
+    data << in.rdbuf();
+    return data.str();
+}
+
+static bool exists(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0;
+}
+
+static std::string part(const std::string& disposition, const std::string& body) {
+    return "--XyZ\r\nContent-Disposition: form-data; " + disposition + "\r\n"
+           "Content-Type: text/plain\r\n\r\n" + body + "\r\n";
+}
+
+int main() {
+    char dir_template[] = "/tmp/six-multipart-XXXXXX";
+    std::string dir = mkdtemp(dir_template);
+
+    std::string first(100000, 'a');
+    std::string second = "second file, ends like a delimiter\r\n--Xy";
+    std::string body = "preamble\r\n" +
+                       part("name=\"title\"", "holiday") +
+                       part("name=\"photos\"; filename=\"one.txt\"", first) +
+                       part("name=\"photos\"; filename=\"two.txt\"", second) +
+                       part("name=\"other\"; filename=\"three.txt\"", "") +
+                       "--XyZ--\r\n";
+
+    std::string temp_one, temp_two;
+    {
+        MultipartParser parser("XyZ", dir, 1024);
+        // Odd-sized pieces so delimiters straddle feed() calls.
+        for (size_t i = 0; i < body.size(); i += 7) {
+            parser.feed(body.data() + i, std::min<size_t>(7, body.size() - i));
+        }
+        expect(parser.finish(), "well-formed body is accepted");
+        expect(parser.fields["title"] == "holiday", "text field");
+
+        expect(parser.files.count("photos") == 2, "both files under one name are kept");
+        expect(parser.files.count("other") == 1, "empty file part is kept");
+        if (parser.files.count("photos") != 2) {
+            printf("FAIL (stopping)\n");
+            return 1;
+        }
+
+        auto begin = parser.files.find("photos");
+        const UploadedFile& one = begin->second;
+        const UploadedFile& two = std::next(begin)->second;
+        expect(one.filename == "one.txt" && two.filename == "two.txt", "files kept in the order sent");
+        expect(one.size == first.size() && slurp(one.path) == first, "first file contents");
+        expect(two.size == second.size() && slurp(two.path) == second, "second file contents");
+        expect(one.content_type == "text/plain", "content type");
+
+        temp_one = one.path;
+        temp_two = two.path;
+
+        std::string saved = dir + "/saved.txt";
+        expect(one.save(saved), "save succeeds");
+        expect(one.path == saved, "path names the saved file");
+        expect(!exists(temp_one) && slurp(saved) == first, "save moved the file");
+
+        std::string moved = dir + "/moved.txt";
+        expect(one.save(moved), "second save succeeds");
+        expect(one.path == moved && !exists(saved), "second save moves from the saved path");
+    }
+
+    expect(exists(dir + "/moved.txt"), "saved file outlives the parser");
+    expect(!exists(temp_two), "unsaved temp file is removed with the parser");
+
+    {
+        // Two fields of 600 bytes each pass a 1000 byte field limit together.
+        std::string big(600, 'x');
+        std::string over = part("name=\"a\"", big) + part("name=\"b\"", big) + "--XyZ--\r\n";
+        MultipartParser parser("XyZ", dir, 1000);
+        parser.feed(over.data(), over.size());
+        expect(!parser.finish() && parser.error() == 413, "field limit is enforced");
+    }
+
+    unlink((dir + "/moved.txt").c_str());
+    rmdir(dir.c_str());
+
+    if (failures) return 1;
+    printf("ok\n");
+    return 0;
+}
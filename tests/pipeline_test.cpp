@@ -0,0 +1,168 @@
+// Request framing checks against a live server on a loopback port.
+//
+// Build and run from the repository root:
+//   g++ -std=c++17 -pthread tests/pipeline_test.cpp -o pipeline_test -lz -lssl -lcrypto && ./pipeline_test
+
+#include "../core/six_http_server.h"
+#include <cstdio>
+
+void load_current_user() {}
+void six_sql_clear_pending() {}
+
+static int failures = 0;
+static int port = 0;
+
+static int free_port() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    ::bind(fd, (sockaddr*)&addr, sizeof(addr));
+    getsockname(fd, (sockaddr*)&addr, &len);
+    close(fd);
+    return ntohs(addr.sin_port);
+}
+
+static int connect_server() {
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    for (int attempt = 0; attempt < 100; ++attempt) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0) return fd;
+        close(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    return -1;
+}
+
+// Sends `request` in one write, and `rest` in a second one a little later,
+// and returns everything the server sends back until it closes the connection.
+static string exchange(const string& request, const string& rest = "") {
+    int fd = connect_server();
+    if (fd < 0) return "";
+    timeval timeout{2, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    send(fd, request.data(), request.size(), MSG_NOSIGNAL);
+    if (!rest.empty()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        send(fd, rest.data(), rest.size(), MSG_NOSIGNAL);
+    }
+
+    string response;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+        response.append(buffer, n);
+    }
+    close(fd);
+    return response;
+}
+
+static void expect(const char* name, const string& got, const string& want) {
+    if (got != want) {
+        printf("FAIL %s:\n--- got\n%s\n--- want\n%s\n", name, got.c_str(), want.c_str());
+        failures++;
+    }
+}
+
+// Status and body of each response in `raw`, joined as "200 body|404 body".
+// Bodies are framed by Content-Length, except that the responses flagged in
+// `head` answer a HEAD and have none.
+static string summarize(const string& raw, const std::vector<bool>& head) {
+    string summary;
+    size_t pos = 0;
+    for (size_t i = 0; pos < raw.size(); ++i) {
+        size_t head_end = raw.find("\r\n\r\n", pos);
+        if (head_end == string::npos) return summary + "<truncated>";
+        string status = raw.substr(pos + 9, 3);
+        size_t length = 0;
+        size_t field = raw.find("Content-Length: ", pos);
+        if (field != string::npos && field < head_end) length = strtoul(raw.c_str() + field + 16, nullptr, 10);
+        if (i < head.size() && head[i]) length = 0;
+
+        pos = head_end + 4;
+        if (!summary.empty()) summary += '|';
+        summary += status + " " + raw.substr(pos, length);
+        pos += length;
+    }
+    return summary;
+}
+
+int main() {
+    port = free_port();
+    static six server(port, 2);
+    server.setAccessLog(LogFormat::Off);
+    server.get("/", [](const http_request&) { return http_response("hello"); });
+    server.post("/echo", [](const http_request& req) { return http_response(req.body); });
+    server.post("/count", [](const http_request& req) {
+        return http_response(to_string(std::count(req.body.begin(), req.body.end(), 'x')));
+    });
+    server.get("/slow", [](const http_request&) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+        return http_response("late");
+    });
+    server.setHandlerTimeout(1);
+    std::thread([] { server.start(); }).detach();
+
+    // HEAD leaves the body off, so the GET pipelined behind it is framed right.
+    expect("pipelined HEAD + GET",
+           summarize(exchange("HEAD / HTTP/1.1\r\nHost: t\r\n\r\n"
+                              "GET / HTTP/1.1\r\nHost: t\r\nConnection: close\r\n\r\n"), {true, false}),
+           "200 |200 hello");
+    expect("HEAD of a missing page",
+           summarize(exchange("HEAD /missing HTTP/1.1\r\nHost: t\r\n\r\n"
+                              "GET / HTTP/1.1\r\nHost: t\r\nConnection: close\r\n\r\n"), {true, false}),
+           "404 |200 hello");
+
+    // A body the server doesn't decode must not be parsed as more requests.
+    string smuggled = "0\r\n\r\nGET / HTTP/1.1\r\nHost: t\r\n\r\n";
+    expect("Transfer-Encoding",
+           summarize(exchange("POST /echo HTTP/1.1\r\nHost: t\r\nTransfer-Encoding: chunked\r\n\r\n" + smuggled), {}),
+           "501 <h1>Not Implemented</h1>");
+    expect("Transfer-Encoding with Content-Length",
+           summarize(exchange("POST /echo HTTP/1.1\r\nHost: t\r\nTransfer-Encoding: chunked\r\n"
+                              "Content-Length: " + to_string(smuggled.size()) + "\r\n\r\n" + smuggled), {}),
+           "400 <h1>Bad Request</h1>");
+    expect("Content-Length body",
+           summarize(exchange("POST /echo HTTP/1.1\r\nHost: t\r\nContent-Length: 5\r\nConnection: close\r\n\r\nhello"), {}),
+           "200 hello");
+
+    // A body that arrives after its head, and is bigger than the first reservation.
+    string body(200 * 1024, 'x');
+    expect("body sent after the head",
+           summarize(exchange("POST /count HTTP/1.1\r\nHost: t\r\nConnection: close\r\n"
+                              "Content-Length: " + to_string(body.size()) + "\r\n\r\n" + body.substr(0, 1000),
+                              body.substr(1000)), {}),
+           "200 " + to_string(body.size()));
+
+    // A handler past its deadline gets a 504. Its response, arriving while the
+    // client still holds the connection open, is dropped rather than sent.
+    {
+        int fd = connect_server();
+        timeval timeout{3, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        string request = "GET /slow HTTP/1.1\r\nHost: t\r\n\r\n";
+        send(fd, request.data(), request.size(), MSG_NOSIGNAL);
+
+        string response;
+        char buffer[4096];
+        ssize_t n;
+        while ((n = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+            response.append(buffer, n);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+        close(fd);
+        expect("handler timeout", summarize(response, {}), "504 <h1>Gateway Timeout</h1>");
+    }
+    expect("after a handler timeout",
+           summarize(exchange("GET / HTTP/1.1\r\nHost: t\r\nConnection: close\r\n\r\n"), {}),
+           "200 hello");
+
+    if (failures == 0) printf("ok\n");
+    fflush(stdout);
+    // The server never returns from start(), so skip static destruction.
+    _exit(failures == 0 ? 0 : 1);
+}
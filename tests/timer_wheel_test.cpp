@@ -0,0 +1,109 @@
+// TimerWheel scheduling, re-arming, cancelling and cascading checks.
+//
+// Build and run from the repository root:
+//   g++ -std=c++17 tests/timer_wheel_test.cpp -o timer_wheel_test && ./timer_wheel_test
+
+#include "../core/six_timer_wheel.h"
+#include <cstdio>
+#include <string>
+#include <vector>
+
+static int failures = 0;
+
+static void expect(const char* name, uint64_t got, uint64_t want) {
+    if (got != want) {
+        printf("FAIL %s: got %llu, want %llu\n", name, (unsigned long long)got, (unsigned long long)want);
+        failures++;
+    }
+}
+
+struct Timer : TimerNode {
+    int id = 0;
+};
+
+// Advances `wheel` to `now` and returns the ids fired, in order, as "1,2".
+static std::string fire(TimerWheel& wheel, uint64_t now) {
+    std::string fired;
+    wheel.advance(now, [&](TimerNode& node) {
+        if (!fired.empty()) fired += ',';
+        fired += std::to_string(static_cast<Timer&>(node).id);
+    });
+    return fired;
+}
+
+static void expect_fired(const char* name, const std::string& got, const std::string& want) {
+    if (got != want) {
+        printf("FAIL %s: fired \"%s\", want \"%s\"\n", name, got.c_str(), want.c_str());
+        failures++;
+    }
+}
+
+int main() {
+    // Re-arming an armed timer moves it without counting it twice.
+    {
+        TimerWheel wheel;
+        Timer a;
+        a.id = 1;
+        for (uint64_t tick = 10; tick < 1010; ++tick) wheel.schedule(a, tick);
+        expect("re-armed size", wheel.size(), 1);
+        expect("re-armed next tick", wheel.nextTick(), 64);
+        expect_fired("re-armed early", fire(wheel, 1008), "");
+        expect_fired("re-armed due", fire(wheel, 1009), "1");
+        expect("re-armed size after firing", wheel.size(), 0);
+        expect("re-armed next tick after firing", wheel.nextTick(), TimerWheel::NEVER);
+    }
+
+    // Cancelled timers never fire, and cancelling twice is harmless.
+    {
+        TimerWheel wheel;
+        Timer a, b;
+        a.id = 1;
+        b.id = 2;
+        wheel.schedule(a, 5);
+        wheel.schedule(b, 5);
+        wheel.cancel(a);
+        wheel.cancel(a);
+        expect("cancel size", wheel.size(), 1);
+        expect_fired("cancel", fire(wheel, 5), "2");
+        wheel.cancel(b);
+        expect("cancel after firing", wheel.size(), 0);
+        expect("cancel next tick", wheel.nextTick(), TimerWheel::NEVER);
+    }
+
+    // Timers on higher levels cascade down and fire on their exact tick.
+    {
+        TimerWheel wheel;
+        std::vector<Timer> timers(6);
+        uint64_t expires[] = {3, 64, 100, 4095, 4096, 300000};
+        for (size_t i = 0; i < timers.size(); ++i) {
+            timers[i].id = (int)i + 1;
+            wheel.schedule(timers[i], expires[i]);
+        }
+        expect("cascade size", wheel.size(), 6);
+        expect_fired("cascade level 0", fire(wheel, 63), "1");
+        expect_fired("cascade level 1 boundary", fire(wheel, 64), "2");
+        expect_fired("cascade level 1", fire(wheel, 99), "");
+        expect_fired("cascade level 1 due", fire(wheel, 100), "3");
+        expect_fired("cascade level 2", fire(wheel, 4096), "4,5");
+        expect_fired("cascade level 3 early", fire(wheel, 299999), "");
+        expect_fired("cascade level 3 due", fire(wheel, 300000), "6");
+        expect("cascade size after firing", wheel.size(), 0);
+    }
+
+    // An expiry callback may re-arm the timer it was called for.
+    {
+        TimerWheel wheel;
+        Timer a;
+        a.id = 1;
+        wheel.schedule(a, 2);
+        int fired = 0;
+        wheel.advance(10, [&](TimerNode& node) {
+            if (++fired < 3) wheel.schedule(node, 2 + fired * 3);
+        });
+        expect("re-armed from callback", fired, 3);
+        expect("re-armed from callback size", wheel.size(), 0);
+    }
+
+    if (failures == 0) printf("ok\n");
+    return failures == 0 ? 0 : 1;
+}